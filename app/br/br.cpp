@@ -256,7 +256,7 @@ private:
                "\n"
                "==== Other Commands ====\n"
                "-fuse <simmat> ... <simmat> (None|MinMax|ZScore|WScore) (Min|Max|Sum[W1:W2:...:Wn]|Replace|Difference|None) {simmat}\n"
-               "-cluster <simmat> ... <simmat> <aggressiveness> {csv}\n"
+               "-cluster (<simmat> ... <simmat>|<gallery>) <aggressiveness> {csv}\n"
                "-makeMask <target_gallery> <query_gallery> {mask}\n"
                "-combineMasks <mask> ... <mask> {mask} (And|Or)\n"
                "-cat <gallery> ... <gallery> {gallery}\n"
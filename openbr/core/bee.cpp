@@ -19,6 +19,10 @@
 #include <QtXml>
 #endif // BR_EMBEDDED
 
+#ifdef __F16C__
+#include <immintrin.h>
+#endif // __F16C__
+
 #include "bee.h"
 #include "opencvutils.h"
 #include "qtutils.h"
@@ -128,7 +132,7 @@ void writeSigset(const QString &sigset, const FileList &files, bool ignoreMetada
     QtUtils::writeFile(sigset, lines);
 }
 
-Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset, bool keepHalf)
 {
     QFile file(matrix);
     bool success = file.open(QFile::ReadOnly);
@@ -149,46 +153,191 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
     const QStringList words = QString(file.readLine()).split(" ");
     const int rows = words[1].toInt();
     const int cols = words[2].toInt();
+
+    // Compressed sparse row, missing scores are -FLT_MAX
+    if (words[0][0] == 'C') {
+        file.close();
+        return MatrixReader(matrix).read(rows);
+    }
+
     const bool isMask = words[0][1] == 'B';
-    const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    const bool isHalf = words[0][1] == 'H';
+    const int typeSize = isMask ? sizeof(BEE::MaskValue) : (isHalf ? sizeof(BEE::HalfSimmatValue) : sizeof(BEE::SimmatValue));
 
-    // Get matrix data
-    Mat m;
+    // Get matrix data, half precision scores are converted a row at a time unless requested as is
+    Mat m, halfRow;
     if (isMask)
         m.create(rows, cols, OpenCVType<BEE::MaskValue,1>::make());
+    else if (isHalf && keepHalf)
+        m.create(rows, cols, OpenCVType<BEE::HalfSimmatValue,1>::make());
     else
         m.create(rows, cols, OpenCVType<BEE::SimmatValue,1>::make());
+    if (isHalf && !keepHalf)
+        halfRow.create(1, cols, OpenCVType<BEE::HalfSimmatValue,1>::make());
 
     const qint64 bytesPerRow = m.cols * typeSize;
     for (int i=0; i<m.rows; i++) {
-        Mat aRow = m.row(i);
+        Mat aRow = (isHalf && !keepHalf) ? halfRow : m.row(i);
         qint64 bytesRead = file.read((char *)aRow.data, bytesPerRow);
         if (bytesRead != bytesPerRow)
             qFatal("Didn't read complete row!");
+        if (isHalf && !keepHalf)
+            fromHalf(halfRow.ptr<BEE::HalfSimmatValue>(), m.ptr<BEE::SimmatValue>(i), cols);
     }
     if (!file.atEnd())
         qFatal("Expected matrix end of file.");
     file.close();
 
     Mat result = m;
-    if (isDistance ^ matrix.get<bool>("negate", false))
-        m.convertTo(result, -1, -1);
+    if (isDistance ^ matrix.get<bool>("negate", false)) {
+        if (m.type() == OpenCVType<BEE::HalfSimmatValue,1>::make())
+            bitwise_xor(m, Scalar(0x8000), result); // Flip the sign bit
+        else
+            m.convertTo(result, -1, -1);
+    }
     return result;
 }
 
 void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
 {
-    bool isMask = false;
-    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
-        isMask = true;
-    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
-        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
+    MatrixWriter(fileName, m.rows, m.cols, m.type(), targetSigset, querySigset).write(m);
+}
+
+MatrixReader::MatrixReader(const File &matrix)
+    : file(matrix), position(0)
+{
+    if (!file.open(QFile::ReadOnly))
+        qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
+
+    // Check format
+    const QByteArray format = file.readLine();
+    if (format[1] != '2') qFatal("Invalid matrix header.");
+    negate = (format[0] == 'D') ^ matrix.get<bool>("negate", false);
+    target = file.readLine().simplified();
+    query = file.readLine().simplified();
+
+    // Get matrix size
+    const QStringList words = QString(file.readLine()).split(" ");
+    rows = words[1].toInt();
+    cols = words[2].toInt();
+    isMask = words[0][1] == 'B';
+    isHalf = words[0][1] == 'H';
+    isSparse = words[0][0] == 'C';
+    dataOffset = file.pos();
+    if (!isSparse)
+        return;
+
+    // Entries are (int32 column, float32 or float16 score) records in row order,
+    // followed by (rows+1) int64 row pointers and the int64 entry count.
+    qint64 nnz;
+    if (!file.seek(file.size() - sizeof(qint64)) || (file.read((char*)&nnz, sizeof(qint64)) != sizeof(qint64)))
+        qFatal("Invalid sparse matrix trailer.");
+
+    rowPointers.resize(rows+1);
+    const qint64 rowPointersSize = sizeof(qint64)*(rows+1);
+    if (!file.seek(dataOffset + nnz*typeSize()) || (file.read((char*)rowPointers.data(), rowPointersSize) != rowPointersSize))
+        qFatal("Invalid sparse matrix row pointers.");
+    if (file.pos() + qint64(sizeof(qint64)) != file.size())
+        qFatal("Expected matrix end of file.");
+    file.seek(dataOffset);
+}
+
+int MatrixReader::typeSize() const
+{
+    const int valueSize = isMask ? sizeof(MaskValue) : (isHalf ? sizeof(HalfSimmatValue) : sizeof(SimmatValue));
+    return isSparse ? sizeof(qint32) + valueSize : valueSize;
+}
 
-    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-    const QString matrixType = isMask ? "B" : "F";
+const uchar *MatrixReader::map()
+{
+    if (isSparse)
+        qFatal("Expected a dense matrix.");
+    const qint64 size = dataOffset + qint64(rows) * cols * typeSize();
+    if (file.size() < size)
+        qFatal("Expected %lld bytes in %s, found %lld.", size, qPrintable(file.fileName()), file.size());
+    const uchar *data = file.map(0, size);
+    if (data == NULL)
+        qFatal("Unable to map %s.", qPrintable(file.fileName()));
+    return data + dataOffset;
+}
+
+Mat MatrixReader::read(int count)
+{
+    if (isSparse) {
+        const float missing = -std::numeric_limits<float>::max();
+        Mat m(count, cols, OpenCVType<SimmatValue,1>::make(), Scalar(negate ? -missing : missing));
+        QVector<qint32> columns;
+        QVector<float> scores;
+        for (int i=0; i<count; i++) {
+            readSparse(columns, scores);
+            float *row = m.ptr<float>(i);
+            for (int j=0; j<columns.size(); j++)
+                row[columns[j]] = scores[j];
+        }
+        return m;
+    }
+
+    Mat m(count, cols, isMask ? OpenCVType<MaskValue,1>::make() : (isHalf ? OpenCVType<HalfSimmatValue,1>::make() : OpenCVType<SimmatValue,1>::make()));
+    const qint64 bytes = qint64(count) * cols * typeSize();
+    if (file.read((char*)m.data, bytes) != bytes)
+        qFatal("Didn't read complete block!");
+    if (isMask)
+        return m;
+
+    Mat scores = m;
+    if (isHalf) {
+        scores.create(count, cols, OpenCVType<SimmatValue,1>::make());
+        for (int i=0; i<count; i++)
+            fromHalf(m.ptr<HalfSimmatValue>(i), scores.ptr<SimmatValue>(i), cols);
+    }
+    if (negate)
+        scores.convertTo(scores, -1, -1);
+    return scores;
+}
+
+void MatrixReader::readSparse(QVector<qint32> &columns, QVector<float> &scores)
+{
+    if (!isSparse)
+        qFatal("Expected a sparse matrix.");
+    if (position >= rows)
+        qFatal("Read past the last row.");
+
+    const qint64 count = rowPointers[position+1] - rowPointers[position];
+    const qint64 entrySize = typeSize();
+    buffer = file.read(count*entrySize);
+    if (buffer.size() != count*entrySize)
+        qFatal("Didn't read complete row!");
+    position++;
+
+    columns.resize(count);
+    scores.resize(count);
+    const char *entry = buffer.constData();
+    for (qint64 j=0; j<count; j++, entry+=entrySize) {
+        memcpy(&columns[j], entry, sizeof(qint32));
+        if ((columns[j] < 0) || (columns[j] >= cols))
+            qFatal("Sparse matrix column index out of range.");
+        if (isHalf) {
+            quint16 score;
+            memcpy(&score, entry + sizeof(qint32), sizeof(quint16));
+            scores[j] = fromHalf(score);
+        } else {
+            memcpy(&scores[j], entry + sizeof(qint32), sizeof(float));
+        }
+        if (negate)
+            scores[j] = -scores[j];
+    }
+}
+
+MatrixWriter::MatrixWriter(const QString &fileName, int rows, int cols, int type, const QString &targetSigset, const QString &querySigset)
+    : file(fileName), type(type)
+{
+    QString matrixType;
+    if      (type == OpenCVType<MaskValue,1>::make())       matrixType = "B";
+    else if (type == OpenCVType<HalfSimmatValue,1>::make()) matrixType = "H";
+    else if (type == OpenCVType<SimmatValue,1>::make())     matrixType = "F";
+    else qFatal("Invalid matrix type, .mtx files can only contain single channel float, half float or uchar matrices.");
 
     char buff[4];
-    QFile file(fileName);
     QtUtils::touchDir(file);
     if (!file.open(QFile::WriteOnly))
         qFatal("Unable to open %s for writing.", qPrintable(fileName));
@@ -200,16 +349,22 @@ void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSig
     file.write("M");
     file.write(qPrintable(matrixType));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(cols)));
     file.write(" ");
     const int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
     file.write("\n");
-    file.write((const char*)m.data, m.rows*m.cols*elemSize);
-    file.close();
+}
+
+void MatrixWriter::write(const Mat &rows)
+{
+    if (rows.type() != type)
+        qFatal("Matrix type mismatch.");
+    for (int i=0; i<rows.rows; i++)
+        file.write((const char*)rows.ptr(i), rows.cols*rows.elemSize());
 }
 
 void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
@@ -224,11 +379,95 @@ void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const
     writeMatrix(readMatrix(matrix), matrix, targetSigset, querySigset);
 }
 
+quint16 toHalf(float value)
+{
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(float));
+    const quint16 sign = (bits >> 16) & 0x8000;
+    const int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    quint32 mantissa = bits & 0x007fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) // Infinity or NaN
+        return sign | 0x7c00 | (mantissa ? 0x0200 : 0);
+    if (exponent >= 0x1f) // Overflow
+        return sign | 0x7c00;
+
+    // Round to nearest even, a carry into the exponent is still correct
+    quint32 half, remainder, halfway;
+    if (exponent <= 0) { // Subnormal
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x00800000;
+        const int shift = 14 - exponent;
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        half = (quint32(exponent) << 10) | (mantissa >> 13);
+        remainder = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+    if ((remainder > halfway) || ((remainder == halfway) && (half & 1)))
+        half++;
+    return sign | quint16(half);
+}
+
+float fromHalf(quint16 value)
+{
+    const quint32 sign = quint32(value & 0x8000) << 16;
+    const int exponent = (value >> 10) & 0x1f;
+    quint32 mantissa = value & 0x03ff;
+
+    quint32 bits;
+    if ((exponent == 0x1f) && (mantissa == 0)) { // -FLT_MAX and FLT_MAX overflow to infinity when narrowed, restore them
+        return sign ? -std::numeric_limits<float>::max() : std::numeric_limits<float>::max();
+    } else if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | (quint32(exponent - 15 + 127) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else { // Subnormal, renormalize
+        int shift = -1;
+        do { shift++; mantissa <<= 1; } while (!(mantissa & 0x0400));
+        bits = sign | (quint32(127 - 15 - shift) << 23) | ((mantissa & 0x03ff) << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+void toHalf(const float *src, quint16 *dst, int n)
+{
+    int i = 0;
+#ifdef __F16C__
+    for (; i+8<=n; i+=8)
+        _mm_storeu_si128((__m128i*)(dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), 0 /* Round to nearest even */));
+#endif // __F16C__
+    for (; i<n; i++)
+        dst[i] = toHalf(src[i]);
+}
+
+void fromHalf(const quint16 *src, float *dst, int n)
+{
+    int i = 0;
+#ifdef __F16C__
+    // Clamp infinity to +/-FLT_MAX like fromHalf(quint16), NaN passes through as the second operand
+    const __m256 lo = _mm256_set1_ps(-std::numeric_limits<float>::max());
+    const __m256 hi = _mm256_set1_ps(std::numeric_limits<float>::max());
+    for (; i+8<=n; i+=8)
+        _mm256_storeu_ps(dst+i, _mm256_max_ps(lo, _mm256_min_ps(hi, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src+i))))));
+#endif // __F16C__
+    for (; i<n; i++)
+        dst[i] = fromHalf(src[i]);
+}
+
 void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
 {
     qDebug("Making mask from %s and %s to %s", qPrintable(targetInput), qPrintable(queryInput), qPrintable(mask));
-    const FileList targets = TemplateList::fromGallery(targetInput).files();
-    const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
+    const FileList targets = TemplateList::fromGallery(targetInput, false).files();
+    const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput, false).files();
     const int partitions = targets.first().get<int>("crossValidate");
     if (partitions == 0) {
         writeMatrix(makeMask(targets, queries), mask, targetInput, queryInput);
@@ -243,8 +482,8 @@ void makeMask(const QString &targetInput, const QString &queryInput, const QStri
 void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask)
 {
     qDebug("Making pairwise mask from %s and %s to %s", qPrintable(targetInput), qPrintable(queryInput), qPrintable(mask));
-    const FileList targets = TemplateList::fromGallery(targetInput).files();
-    const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput).files();
+    const FileList targets = TemplateList::fromGallery(targetInput, false).files();
+    const FileList queries = (queryInput == ".") ? targets : TemplateList::fromGallery(queryInput, false).files();
     const int partitions = targets.first().get<int>("crossValidate");
     if (partitions == 0) {
         writeMatrix(makePairwiseMask(targets, queries), mask, targetInput, queryInput);
@@ -292,40 +531,77 @@ Mat makePairwiseMask(const FileList &targets, const FileList &queries, int parti
 
 Mat makeMask(const FileList &targets, const FileList &queries, int partition)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
-    const QList<bool> targetsOnly = File::get<bool>(queries, "targetOnly", false);
+    return ImplicitMask(targets, queries, partition).toMat();
+}
 
-    Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-        const bool targetOnly = targetsOnly[i];
+// Interns strings to dense ids in order of appearance, optionally mapping one value to -1
+static QVector<int> toIds(const QStringList &values, QHash<QString,int> &ids, const QString &none = QString())
+{
+    QVector<int> result; result.reserve(values.size());
+    foreach (const QString &value, values) {
+        if (!none.isNull() && (value == none)) {
+            result.append(-1);
+            continue;
+        }
+        QHash<QString,int>::const_iterator it = ids.constFind(value);
+        if (it == ids.constEnd())
+            it = ids.insert(value, ids.size());
+        result.append(it.value());
+    }
+    return result;
+}
 
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
+ImplicitMask::ImplicitMask(const FileList &targets, const FileList &queries, int partition)
+    : partition(partition)
+{
+    // TODO: Direct use of "Label" isn't general -cao
+    QHash<QString,int> labelIds, fileIds;
+    targetLabels = toIds(File::get<QString>(targets, "Label", "-1"), labelIds, "-1");
+    queryLabels = toIds(File::get<QString>(queries, "Label", "-1"), labelIds, "-1");
+    targetFiles = toIds(targets.names(), fileIds);
+    queryFiles = toIds(queries.names(), fileIds);
+    targetPartitions = targets.crossValidationPartitions().toVector();
+    queryPartitions = queries.crossValidationPartitions().toVector();
+    targetOnly = File::get<bool>(queries, "targetOnly", false).toVector();
+}
 
-            MaskValue val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (targetOnly)               val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
-        }
+MaskValue ImplicitMask::at(int i, int j) const
+{
+    if      (queryFiles[i] == targetFiles[j])      return DontCare;
+    else if (targetOnly[i])                        return DontCare;
+    else if (queryLabels[i] == -1)                 return DontCare;
+    else if (targetLabels[j] == -1)                return DontCare;
+    else if (queryPartitions[i] != partition)      return DontCare;
+    else if (targetPartitions[j] == -1)            return NonMatch;
+    else if (targetPartitions[j] != partition)     return DontCare;
+    else if (queryLabels[i] == targetLabels[j])    return Match;
+    else                                           return NonMatch;
+}
+
+void ImplicitMask::row(int i, MaskValue *dst) const
+{
+    // Rows that are ignored entirely skip the per column tests
+    if (targetOnly[i] || (queryLabels[i] == -1) || (queryPartitions[i] != partition)) {
+        memset(dst, DontCare, cols());
+        return;
     }
 
+    const int file = queryFiles[i], label = queryLabels[i];
+    for (int j=0; j<cols(); j++) {
+        const int partitionB = targetPartitions[j];
+        if      (file == targetFiles[j])                          dst[j] = DontCare;
+        else if (targetLabels[j] == -1)                           dst[j] = DontCare;
+        else if (partitionB == -1)                                dst[j] = NonMatch;
+        else if (partitionB != partition)                         dst[j] = DontCare;
+        else                                                      dst[j] = (label == targetLabels[j]) ? Match : NonMatch;
+    }
+}
+
+Mat ImplicitMask::toMat() const
+{
+    Mat mask(rows(), cols(), OpenCVType<MaskValue,1>::make());
+    for (int i=0; i<rows(); i++)
+        row(i, mask.ptr<MaskValue>(i));
     return mask;
 }
 
@@ -17,6 +17,7 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
 #include <QString>
 #include <QStringList>
 #include <opencv2/core/core.hpp>
@@ -28,6 +29,7 @@
 namespace BEE
 {
     typedef float SimmatValue;
+    typedef quint16 HalfSimmatValue; // IEEE binary16 bits, stored in CV_16UC1 matrices
     typedef uchar MaskValue;
     const MaskValue Match(0xff);
     const MaskValue NonMatch(0x7f);
@@ -38,17 +40,75 @@ namespace BEE
     void writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata = false);
 
     // Matrix
-    cv::Mat readMatrix(const br::File &mat, QString *targetSigset = NULL, QString *querySigset = NULL);
+    cv::Mat readMatrix(const br::File &mat, QString *targetSigset = NULL, QString *querySigset = NULL, bool keepHalf = false);
     void writeMatrix(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
     void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
 
+    // Reads a matrix a block of rows at a time, scores are widened to float and negated like readMatrix()
+    class MatrixReader
+    {
+        QFile file;
+        qint64 dataOffset;
+        QVector<qint64> rowPointers; // Compressed sparse row matrices only
+        int position;
+        QByteArray buffer;
+
+    public:
+        int rows, cols;
+        bool negate, isHalf, isMask, isSparse;
+        QString target, query;
+
+        MatrixReader(const br::File &matrix);
+        int typeSize() const;
+        const uchar *map(); // Raw data of a dense matrix, valid for the lifetime of the reader
+        cv::Mat read(int count); // Sparse rows are expanded with missing scores as -FLT_MAX
+        void readSparse(QVector<qint32> &columns, QVector<float> &scores); // The stored entries of the next row of a sparse matrix
+    };
+
+    // Writes a dense matrix a block of rows at a time
+    class MatrixWriter
+    {
+        QFile file;
+        int type;
+
+    public:
+        MatrixWriter(const QString &fileName, int rows, int cols, int type, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+        void write(const cv::Mat &rows);
+    };
+
+    // Half precision scores, infinity widens to +/-FLT_MAX so the -FLT_MAX missing score sentinel survives
+    quint16 toHalf(float value);
+    float fromHalf(quint16 value);
+    void toHalf(const float *src, quint16 *dst, int n);
+    void fromHalf(const quint16 *src, float *dst, int n);
+
     // Mask
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makePairwiseMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method);
+
+    // The mask of makeMask() computed on the fly from per-template ids instead of stored
+    class ImplicitMask
+    {
+        QVector<int> targetLabels, queryLabels; // Dense label ids, -1 if unlabeled
+        QVector<int> targetFiles, queryFiles; // Dense file name ids
+        QVector<int> targetPartitions, queryPartitions;
+        QVector<bool> targetOnly;
+        int partition;
+
+    public:
+        ImplicitMask() : partition(0) {}
+        ImplicitMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
+
+        int rows() const { return queryLabels.size(); }
+        int cols() const { return targetLabels.size(); }
+        MaskValue at(int i, int j) const;
+        void row(int i, MaskValue *dst) const;
+        cv::Mat toMat() const;
+    };
 }
 
 #endif // BEE_BEE_H
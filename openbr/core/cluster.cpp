@@ -15,10 +15,15 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QDebug>
+#include <QDir>
 #include <QFile>
+#include <QFutureSynchronizer>
 #include <QHash>
 #include <QPair>
 #include <QSet>
+#include <QSharedPointer>
+#include <QTemporaryFile>
+#include <QtConcurrentRun>
 #include <limits>
 #include <openbr/openbr_plugin.h>
 #include <assert.h>
@@ -82,62 +87,89 @@ float normalizedROD(const Neighborhood &neighborhood, int a, int b)
     return 1.f * (distanceA + distanceB) / std::min(indexA+1, indexB+1);
 }
 
-Neighborhood getNeighborhood(const QList<cv::Mat> &simmats)
+static const int NeighborCutoff = 20; // Somewhat arbitrary number of neighbors to keep
+
+// Keeps the best neighbors offered so far as a heap with the worst neighbor first
+static void offerNeighbor(Neighbors &heap, const Neighbor &neighbor)
 {
-    Neighborhood neighborhood;
+    if (heap.size() < NeighborCutoff) {
+        heap.append(neighbor);
+        std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+    } else if (compareNeighbors(neighbor, heap.first())) {
+        std::pop_heap(heap.begin(), heap.end(), compareNeighbors);
+        heap.last() = neighbor;
+        std::push_heap(heap.begin(), heap.end(), compareNeighbors);
+    }
+}
 
-    float globalMax = -std::numeric_limits<float>::max();
-    float globalMin = std::numeric_limits<float>::max();
-    int numGalleries = (int)sqrt((float)simmats.size());
-    if (numGalleries*numGalleries != simmats.size())
-        qFatal("Incorrect number of similarity matrices.");
+static bool isFinite(float val)
+{
+    return (val != -std::numeric_limits<float>::max())
+           && (val != -std::numeric_limits<float>::infinity())
+           && (val != std::numeric_limits<float>::infinity());
+}
 
-    // Process each simmat
-    for (int i=0; i<numGalleries; i++) {
-        QVector<Neighbors> allNeighbors;
+typedef QPair<float,float> ScoreRange; // QPair<min,max>
 
-        int currentRows = -1;
-        int columnOffset = 0;
-        for (int j=0; j<numGalleries; j++) {
-            cv::Mat m = simmats[i * numGalleries + j];
-            if (j==0) {
-                currentRows = m.rows;
-                allNeighbors.resize(currentRows);
-            }
-            if (currentRows != m.rows) qFatal("Row count mismatch.");
-
-            // Get data row by row
-            for (int k=0; k<m.rows; k++) {
-                Neighbors &neighbors = allNeighbors[k];
-                neighbors.reserve(neighbors.size() + m.cols);
-                for (int l=0; l<m.cols; l++) {
-                    float val = m.at<float>(k,l);
-                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
-
-                    if (val != -std::numeric_limits<float>::max()
-                        && val != -std::numeric_limits<float>::infinity()
-                        && val != std::numeric_limits<float>::infinity()) {
-                        globalMax = std::max(globalMax, val);
-                        globalMin = std::min(globalMin, val);
-                    }
-                    neighbors.append(Neighbor(l+columnOffset, val));
+static void expandRange(ScoreRange &range, float val)
+{
+    if (!isFinite(val)) return;
+    range.first = std::min(range.first, val);
+    range.second = std::max(range.second, val);
+}
+
+// Selects the top neighbors of a band of rows from one row of simmats
+struct NeighborSelector
+{
+    QList<cv::Mat> parts; // Dense simmats or bands of them
+    QList<int> columnOffsets; // Gallery index of the first column of each part
+    QList<bool> diagonal; // Parts on the diagonal skip self-similarity scores
+    QVector<Neighbors> heaps; // Sparse neighbors already offered, one per row
+    int firstRow; // Row of the band within the simmats
+
+    NeighborSelector(int rows, int firstRow)
+        : heaps(rows), firstRow(firstRow) {}
+
+    void select(int begin, int end, Neighbors *output, ScoreRange *range) const
+    {
+        for (int k=begin; k<end; k++) {
+            Neighbors neighbors = heaps[k];
+            for (int p=0; p<parts.size(); p++) {
+                const float *row = parts[p].ptr<float>(k);
+                for (int l=0; l<parts[p].cols; l++) {
+                    if (diagonal[p] && (firstRow+k == l)) continue; // Skips self-similarity scores
+                    expandRange(*range, row[l]);
+                    offerNeighbor(neighbors, Neighbor(l+columnOffsets[p], row[l]));
                 }
             }
-
-            columnOffset += m.cols;
+            std::sort_heap(neighbors.begin(), neighbors.end(), compareNeighbors);
+            output[k] = neighbors;
         }
+    }
+};
 
-        // Keep the top matches
-        for (int j=0; j<allNeighbors.size(); j++) {
-            Neighbors &val = allNeighbors[j];
-            const int cutoff = 20; // Somewhat arbitrary number of neighbors to keep
-            int keep = std::min(cutoff, val.size());
-            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
-            neighborhood.append((Neighbors)val.mid(0, keep));
-        }
+// Threads take contiguous rows of the band
+static void selectNeighbors(const NeighborSelector &selector, Neighbors *output, ScoreRange &range)
+{
+    const int rows = selector.heaps.size();
+    const int threads = std::max(1, Globals->parallelism);
+    QVector<ScoreRange> ranges(threads, range);
+    QFutureSynchronizer<void> futures;
+    for (int t=0; t<threads; t++) {
+        const int begin = rows*t/threads, end = rows*(t+1)/threads;
+        if (begin == end) continue;
+        futures.addFuture(QtConcurrent::run(&selector, &NeighborSelector::select, begin, end, output, &ranges[t]));
+    }
+    futures.waitForFinished();
+
+    foreach (const ScoreRange &partial, ranges) {
+        range.first = std::min(range.first, partial.first);
+        range.second = std::max(range.second, partial.second);
     }
+}
 
-    // Normalize scores
+static void normalizeNeighborhood(Neighborhood &neighborhood, const ScoreRange &range)
+{
     for (int i=0; i<neighborhood.size(); i++) {
         Neighbors &neighbors = neighborhood[i];
         for (int j=0; j<neighbors.size(); j++) {
@@ -147,20 +179,155 @@ Neighborhood getNeighborhood(const QList<cv::Mat> &simmats)
             else if (neighbor.second == std::numeric_limits<float>::infinity())
                 neighbor.second = 1;
             else
-                neighbor.second = (neighbor.second - globalMin) / (globalMax - globalMin);
+                neighbor.second = (neighbor.second - range.first) / (range.second - range.first);
         }
     }
+}
+
+static int galleryCount(int simmats)
+{
+    const int numGalleries = (int)sqrt((float)simmats);
+    if (numGalleries*numGalleries != simmats)
+        qFatal("Incorrect number of similarity matrices.");
+    return numGalleries;
+}
+
+Neighborhood getNeighborhood(const QList<cv::Mat> &simmats)
+{
+    Neighborhood neighborhood;
+    ScoreRange range(std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    const int numGalleries = galleryCount(simmats.size());
+
+    // Process each row of simmats
+    for (int i=0; i<numGalleries; i++) {
+        const int rows = simmats[i * numGalleries].rows;
+        NeighborSelector selector(rows, 0);
+        int columnOffset = 0;
+        for (int j=0; j<numGalleries; j++) {
+            const cv::Mat &m = simmats[i * numGalleries + j];
+            if (m.rows != rows) qFatal("Row count mismatch.");
+            selector.parts.append(m);
+            selector.columnOffsets.append(columnOffset);
+            selector.diagonal.append(i == j);
+            columnOffset += m.cols;
+        }
+
+        neighborhood.resize(neighborhood.size() + rows);
+        selectNeighbors(selector, neighborhood.data() + neighborhood.size() - rows, range);
+    }
+
+    normalizeNeighborhood(neighborhood, range);
     return neighborhood;
 }
 
+// Reads the simmats a band of rows at a time, sparse simmats contribute only their stored scores
+Neighborhood getNeighborhood(const QStringList &simmats)
+{
+    Neighborhood neighborhood;
+    ScoreRange range(std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    const int numGalleries = galleryCount(simmats.size());
+
+    for (int i=0; i<numGalleries; i++) {
+        QList< QSharedPointer<BEE::MatrixReader> > readers;
+        QList<int> columnOffsets;
+        int columns = 0;
+        for (int j=0; j<numGalleries; j++) {
+            readers.append(QSharedPointer<BEE::MatrixReader>(new BEE::MatrixReader(simmats[i * numGalleries + j])));
+            if (readers.last()->rows != readers.first()->rows) qFatal("Row count mismatch.");
+            columnOffsets.append(columns);
+            columns += readers.last()->cols;
+        }
+
+        const int rows = readers.first()->rows;
+        const int bandRows = std::max(1, (1 << 24) / std::max(1, columns));
+        const int rowOffset = neighborhood.size();
+        neighborhood.resize(rowOffset + rows);
+
+        QVector<qint32> sparseColumns;
+        QVector<float> sparseScores;
+        for (int begin=0; begin<rows; begin+=bandRows) {
+            const int count = std::min(bandRows, rows - begin);
+            NeighborSelector selector(count, begin);
+            for (int j=0; j<numGalleries; j++) {
+                BEE::MatrixReader &reader = *readers[j];
+                if (!reader.isSparse) {
+                    selector.parts.append(reader.read(count));
+                    selector.columnOffsets.append(columnOffsets[j]);
+                    selector.diagonal.append(i == j);
+                    continue;
+                }
+
+                for (int k=0; k<count; k++) {
+                    reader.readSparse(sparseColumns, sparseScores);
+                    for (int l=0; l<sparseColumns.size(); l++) {
+                        if ((i == j) && (begin+k == sparseColumns[l])) continue; // Skips self-similarity scores
+                        expandRange(range, sparseScores[l]);
+                        offerNeighbor(selector.heaps[k], Neighbor(sparseColumns[l]+columnOffsets[j], sparseScores[l]));
+                    }
+                }
+            }
+            selectNeighbors(selector, neighborhood.data() + rowOffset + begin, range);
+        }
+    }
+
+    normalizeNeighborhood(neighborhood, range);
+    return neighborhood;
+}
+
+// Flags the neighbors close enough in rank-order distance to merge with
+struct RankOrderEdges
+{
+    const Neighborhood &neighborhood;
+    QVector<int> offsets; // Index of the first edge of each template
+    QVector<char> similar;
+    float threshold;
+
+    RankOrderEdges(const Neighborhood &neighborhood, float threshold)
+        : neighborhood(neighborhood), offsets(neighborhood.size()+1), threshold(threshold)
+    {
+        offsets[0] = 0;
+        for (int i=0; i<neighborhood.size(); i++)
+            offsets[i+1] = offsets[i] + neighborhood[i].size();
+        similar.resize(offsets.last());
+
+        const int threads = std::max(1, Globals->parallelism);
+        QFutureSynchronizer<void> futures;
+        for (int t=0; t<threads; t++) {
+            const int begin = neighborhood.size()*qint64(t)/threads, end = neighborhood.size()*qint64(t+1)/threads;
+            if (begin == end) continue;
+            futures.addFuture(QtConcurrent::run(this, &RankOrderEdges::evaluate, begin, end));
+        }
+        futures.waitForFinished();
+    }
+
+    void evaluate(int begin, int end)
+    {
+        for (int i=begin; i<end; i++)
+            for (int j=0; j<neighborhood[i].size(); j++)
+                similar[offsets[i]+j] = normalizedROD(neighborhood, i, neighborhood[i][j].first) < threshold;
+    }
+
+    bool isSimilar(int i, int j) const
+    {
+        return similar[offsets[i]+j];
+    }
+};
+
 // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
 br::Clusters br::ClusterGallery(const QList<cv::Mat> &simmats, float aggressiveness)
 {
     qDebug("Clustering %d simmat(s), aggressiveness %f", simmats.size(), aggressiveness);
 
     // Read in gallery parts, keeping top neighbors of each template
-    Neighborhood neighborhood = getNeighborhood(simmats);
-    const int cutoff = neighborhood.first().size();
+    return ClusterNeighborhood(getNeighborhood(simmats), aggressiveness);
+}
+
+// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+br::Clusters br::ClusterNeighborhood(Neighborhood neighborhood, float aggressiveness)
+{
+    int cutoff = 0;
+    foreach (const Neighbors &neighbors, neighborhood)
+        cutoff = std::max(cutoff, neighbors.size());
     const float threshold = 3*cutoff/4 * aggressiveness/5;
 
     // Initialize clusters
@@ -170,6 +337,9 @@ br::Clusters br::ClusterGallery(const QList<cv::Mat> &simmats, float aggressiven
 
     bool done = false;
     while (!done) {
+        // The rank-order distances only depend on the neighborhood, compute them all up front
+        const RankOrderEdges edges(neighborhood, threshold);
+
         // nextClusterIds[i] = j means that cluster i is set to merge into cluster j
         QVector<int> nextClusterIDs(neighborhood.size());
         for (int i=0; i<neighborhood.size(); i++) nextClusterIDs[i] = i;
@@ -180,15 +350,15 @@ br::Clusters br::ClusterGallery(const QList<cv::Mat> &simmats, float aggressiven
             int nextClusterID = nextClusterIDs[clusterID];
 
             // Check its neighbors
-            foreach (const Neighbor &neighbor, neighbors) {
-                int neighborID = neighbor.first;
+            for (int j=0; j<neighbors.size(); j++) {
+                int neighborID = neighbors[j].first;
                 int nextNeighborID = nextClusterIDs[neighborID];
 
                 // Don't bother if they have already merged
                 if (nextNeighborID == nextClusterID) continue;
 
                 // Flag for merge if similar enough
-                if (normalizedROD(neighborhood, clusterID, neighborID) < threshold) {
+                if (edges.isSimilar(clusterID, j)) {
                     if (nextClusterID < nextNeighborID) nextClusterIDs[neighborID] = nextClusterID;
                     else                                nextClusterIDs[clusterID] = nextNeighborID;
                 }
@@ -206,10 +376,13 @@ br::Clusters br::ClusterGallery(const QList<cv::Mat> &simmats, float aggressiven
         }
 
         // Construct new clusters
-        QHash<int, int> clusterIDLUT;
         QList<int> allClusterIDs = QSet<int>::fromList(nextClusterIDs.toList()).values();
+        QHash<int, int> allClusterIndices;
+        for (int i=0; i<allClusterIDs.size(); i++)
+            allClusterIndices.insert(allClusterIDs[i], i);
+        QVector<int> clusterIDLUT(neighborhood.size());
         for (int i=0; i<neighborhood.size(); i++)
-            clusterIDLUT[i] = allClusterIDs.indexOf(nextClusterIDs[i]);
+            clusterIDLUT[i] = allClusterIndices[nextClusterIDs[i]];
 
         Clusters newClusters(allClusterIDs.size());
         Neighborhood newNeighborhood(allClusterIDs.size());
@@ -238,16 +411,44 @@ br::Clusters br::ClusterGallery(const QList<cv::Mat> &simmats, float aggressiven
     return clusters;
 }
 
+static bool isBEEMatrix(const File &file)
+{
+    return (QStringList() << "mtx" << "smtx").contains(file.suffix());
+}
+
 br::Clusters br::ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv)
 {
-    QList<cv::Mat> mats;
-    foreach (const QString &simmat, simmats) {
-        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
-        br::Template t = format->read();
-        mats.append(t);
+    QStringList inputs = simmats;
+
+    // A single gallery is compared against itself into a graph of its nearest neighbors,
+    // anything a Format reads is still taken to be a simmat, even if a Gallery reads it too (e.g. csv)
+    const File gallery = simmats.value(0);
+    const QString suffix = gallery.suffix();
+    QTemporaryFile graph(QDir::temp().filePath(gallery.baseName() + ".XXXXXX.smtx"));
+    if ((simmats.size() == 1) && !isBEEMatrix(gallery) && !Factory<Format>::names().contains(suffix)) {
+        if (!graph.open()) qFatal("Failed to create temporary file for %s.", qPrintable(gallery.flat()));
+        graph.close();
+        Compare(gallery, gallery, QString("%1[topK=%2]").arg(graph.fileName(), QString::number(NeighborCutoff+1)));
+        inputs = QStringList(graph.fileName());
     }
 
-    Clusters clusters = ClusterGallery(mats, aggressiveness);
+    bool streamed = true;
+    foreach (const QString &input, inputs)
+        streamed = streamed && isBEEMatrix(input);
+
+    qDebug("Clustering %d simmat(s), aggressiveness %f", inputs.size(), aggressiveness);
+    Clusters clusters;
+    if (streamed) {
+        clusters = ClusterNeighborhood(getNeighborhood(inputs), aggressiveness);
+    } else {
+        // Other formats are read whole
+        QList<cv::Mat> mats;
+        foreach (const QString &input, inputs) {
+            QScopedPointer<br::Format> format(br::Factory<br::Format>::make(input));
+            mats.append(format->read());
+        }
+        clusters = ClusterNeighborhood(getNeighborhood(mats), aggressiveness);
+    }
 
     // Save clusters
     if (!csv.isEmpty())
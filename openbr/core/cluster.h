@@ -22,6 +22,7 @@
 #include <QStringList>
 #include <QVector>
 #include <openbr/openbr_plugin.h>
+#include <openbr/plugins/openbr_internal.h>
 
 namespace br
 {
@@ -30,6 +31,7 @@ namespace br
 
     Clusters ClusterGallery(const QList<cv::Mat> &simmats, float aggressiveness);
     Clusters ClusterGallery(const QStringList &simmats, float aggressiveness, const QString &csv);
+    Clusters ClusterNeighborhood(Neighborhood neighborhood, float aggressiveness); // Rank-order clustering of a k-NN graph
     void EvalClustering(const QString &csv, const QString &input, QString truth_property);
 
     Clusters ReadClusters(const QString &csv);
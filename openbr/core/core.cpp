@@ -684,8 +684,8 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
     } else if (fileType == "Output") {
         QString target, query;
         cv::Mat m = BEE::readMatrix(inputFile, &target, &query);
-        const FileList targetFiles = TemplateList::fromGallery(target).files();
-        const FileList queryFiles = TemplateList::fromGallery(query).files();
+        const FileList targetFiles = TemplateList::fromGallery(target, false).files();
+        const FileList queryFiles = TemplateList::fromGallery(query, false).files();
 
         if ((targetFiles.size() != m.cols || queryFiles.size() != m.rows)
             && (m.cols != 1 || targetFiles.size() != m.rows || queryFiles.size() != m.rows))
@@ -19,7 +19,8 @@
 #include "openbr/core/common.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
-#include <QMapIterator>
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 
 using namespace cv;
 
@@ -115,28 +116,391 @@ static float getCMC(const QVector<int> &firstGenuineReturns, int rank)
     return retrievalRate;
 }
 
-// Decide whether to construct a normal mask matrix, or a pairwise mask by comparing the dimensions of
+// Rows of either an explicit mask matrix or an implicit mask computed on the fly
+class MaskRows
+{
+    Mat explicitMask;
+    QSharedPointer<BEE::ImplicitMask> implicitMask;
+    int rowOffset, rowCount;
+
+public:
+    MaskRows(const Mat &explicitMask = Mat())
+        : explicitMask(explicitMask), rowOffset(0), rowCount(explicitMask.rows) {}
+    MaskRows(const QSharedPointer<BEE::ImplicitMask> &implicitMask)
+        : implicitMask(implicitMask), rowOffset(0), rowCount(implicitMask->rows()) {}
+
+    Size size() const
+    {
+        return implicitMask.isNull() ? explicitMask.size() : Size(implicitMask->cols(), rowCount);
+    }
+
+    MaskRows rowRange(int begin, int end) const
+    {
+        if (implicitMask.isNull())
+            return MaskRows(explicitMask.rowRange(begin, end));
+        MaskRows rows(*this);
+        rows.rowOffset += begin;
+        rows.rowCount = end - begin;
+        return rows;
+    }
+
+    // Implicit rows are written to the buffer
+    const BEE::MaskValue *row(int i, QVector<BEE::MaskValue> &buffer) const
+    {
+        if (implicitMask.isNull())
+            return explicitMask.ptr<BEE::MaskValue>(i);
+        buffer.resize(implicitMask->cols());
+        implicitMask->row(rowOffset+i, buffer.data());
+        return buffer.data();
+    }
+};
+
+// Decide whether to use an implicit mask, or a pairwise mask by comparing the dimensions of
 // scores with the size of the target and query lists
-static cv::Mat constructMatchingMask(const cv::Mat &scores, const FileList &target, const FileList &query, int partition=0)
+static MaskRows constructMatchingMask(const cv::Size &scores, const FileList &target, const FileList &query, int partition=0)
 {
-    // If the dimensions of the score matrix match the sizes of the target and query lists, construct a normal mask matrix
-    if (target.size() == scores.cols && query.size() == scores.rows)
-        return BEE::makeMask(target, query, partition);
+    // If the dimensions of the score matrix match the sizes of the target and query lists, compute the mask from their labels
+    if (target.size() == scores.width && query.size() == scores.height)
+        return MaskRows(QSharedPointer<BEE::ImplicitMask>(new BEE::ImplicitMask(target, query, partition)));
     // If this looks like a pairwise comparison (1 column score matrix, equal length target and query sets), construct a
     // mask for that
-    else if (scores.cols == 1 && target.size() == query.size()) {
-        return BEE::makePairwiseMask(target, query, partition);
+    else if (scores.width == 1 && target.size() == query.size()) {
+        return MaskRows(BEE::makePairwiseMask(target, query, partition));
     }
     // otherwise, we fail
     else
-        qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", scores.rows, scores.cols, query.length(), target.length());
+        qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", scores.height, scores.width, query.length(), target.length());
+
+    return MaskRows();
+}
+
+// Writes the curves and tables common to exact and histogram evaluation, returns TAR @ FAR = 0.01
+static float writeEvaluation(QStringList &lines, const QList<OperatingPoint> &operatingPoints, const QVector<int> &firstGenuineReturns,
+                             const QList<float> &sampledGenuineScores, const QList<float> &sampledImpostorScores,
+                             const QString &csv, const QString &target)
+{
+    float result = -1;
+
+    // Write Detection Error Tradeoff (DET), PRE, REC
+    float FAR=0.000001;
+    for (int i=0; i<Max_Points; i++) {
+        OperatingPoint operatingPoint = getOperatingPointGivenFAR(operatingPoints, FAR);
+        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
+                                              QString::number(1-operatingPoint.TAR)));
+        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPoint.score),
+                                              QString::number(FAR)));
+        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPoint.score),
+                                              QString::number(1-operatingPoint.TAR)));
+        //multiplier roughly spans 10E-6 to 1
+        FAR *=1.02807;
+    }
+
+    // Write TAR@FAR Table (FT)
+    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
+      lines.append(qPrintable(QString("FT,%1,%2").arg(
+						      QString::number(far, 'f'),
+						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
+
+    // Write FAR@TAR Table (FatT)
+    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
+      lines.append(qPrintable(QString("FatT,%1,%2").arg(
+                         QString::number(tar, 'f', 2),
+                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
+
+    //Write CMC Table (CT)
+    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
+    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
+    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
+    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
+    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
+    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
+
+    // Write FAR/TAR Bar Chart (BC)
+    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
+    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
+
+    // Attempt to read template size from enrolled gallery and write to output CSV
+    size_t maxSize(0);
+    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
+        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
+        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
+    }
+
+    // Write SD & KDE
+    for (int i=0; i<sampledGenuineScores.size(); i++) {
+        lines.append(QString("SD,%1,Genuine").arg(QString::number(sampledGenuineScores[i])));
+        lines.append(QString("SD,%1,Impostor").arg(QString::number(sampledImpostorScores[i])));
+    }
+
+    // Write Cumulative Match Characteristic (CMC) curve
+    const int Max_Retrieval = 200;
+    const int Report_Retrieval = 5;
+    for (int i=1; i<=Max_Retrieval; i++) {
+        const float retrievalRate = getCMC(firstGenuineReturns, i);
+        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+    }
+
+    QtUtils::writeFile(csv, lines);
+    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
+    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
+    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
+    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
+    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
 
-    return cv::Mat();
+    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+
+    return result;
 }
 
+// Width of the straddling segment, which bounds how far the interpolated TAR can be from any curve through the same points
+static float getTARUncertaintyGivenFAR(const QList<OperatingPoint> &operatingPoints, float FAR)
+{
+    int index = 0;
+    while ((index < operatingPoints.size()) && (operatingPoints[index].FAR < FAR))
+        index++;
+    if (index == operatingPoints.size())
+        return 1 - operatingPoints.last().TAR;
+    return operatingPoints[index].TAR - (index == 0 ? 0 : operatingPoints[index-1].TAR);
+}
+
+/*!
+ * Genuine and impostor counts binned on the leading bits of an order preserving integer encoding of the score.
+ * The encoding keeps the sign, exponent and leading (bits-9) mantissa bits,
+ * so bins have a fixed relative width and no score range needs to be known in advance.
+ */
+struct ScoreHistogram
+{
+    int shift;
+    QVector<qint64> genuines, impostors;
+    qint64 genuineCount, impostorCount, numNaNs;
+    float minGenuineScore, minImpostorScore;
+
+    explicit ScoreHistogram(int bits = 0)
+        : shift(32-bits), genuines(bits > 0 ? 1 << bits : 0), impostors(bits > 0 ? 1 << bits : 0),
+          genuineCount(0), impostorCount(0), numNaNs(0),
+          minGenuineScore(std::numeric_limits<float>::max()), minImpostorScore(std::numeric_limits<float>::max()) {}
+
+    int bin(float score) const
+    {
+        quint32 bits;
+        memcpy(&bits, &score, sizeof(float));
+        return ((bits & 0x80000000) ? ~bits : (bits | 0x80000000)) >> shift;
+    }
+
+    // The lowest score in the bin
+    float score(int bin) const
+    {
+        const quint32 key = quint32(bin) << shift;
+        const quint32 bits = (key & 0x80000000) ? (key & 0x7fffffff) : ~key;
+        float score;
+        memcpy(&score, &bits, sizeof(float));
+        return score;
+    }
+
+    // Accumulates a row of scores, returning the rank of its best genuine score or 0 if it has none
+    int addRow(const float *scores, const BEE::MaskValue *mask, int cols)
+    {
+        float bestGenuine = -std::numeric_limits<float>::max();
+        bool hasGenuine = false;
+        for (int j=0; j<cols; j++) {
+            if (mask[j] == BEE::DontCare) continue;
+            if (scores[j] != scores[j]) { numNaNs++; continue; }
+            const float score = std::max(-std::numeric_limits<float>::max(), std::min(std::numeric_limits<float>::max(), scores[j]));
+            if (mask[j] == BEE::Match) {
+                genuines[bin(score)]++;
+                genuineCount++;
+                if ((score != -std::numeric_limits<float>::max()) && (score < minGenuineScore))
+                    minGenuineScore = score;
+                if (!hasGenuine || (score > bestGenuine))
+                    bestGenuine = score;
+                hasGenuine = true;
+            } else {
+                impostors[bin(score)]++;
+                impostorCount++;
+                if ((score != -std::numeric_limits<float>::max()) && (score < minImpostorScore))
+                    minImpostorScore = score;
+            }
+        }
+
+        if (!hasGenuine)
+            return 0;
+
+        // Ties are ranked pessimistically, as in the exact evaluation
+        int rank = 1;
+        for (int j=0; j<cols; j++)
+            if ((mask[j] != BEE::DontCare) && (mask[j] != BEE::Match) && (scores[j] == scores[j]) &&
+                (std::max(-std::numeric_limits<float>::max(), scores[j]) >= bestGenuine))
+                rank++;
+        return rank;
+    }
+
+    void addRows(const cv::Mat &simmat, const MaskRows &mask, int begin, int end, int *firstGenuineReturns)
+    {
+        QVector<BEE::SimmatValue> widened(simmat.type() == CV_16UC1 ? simmat.cols : 0);
+        QVector<BEE::MaskValue> maskRow;
+        for (int i=begin; i<end; i++) {
+            const BEE::SimmatValue *scores = widened.isEmpty() ? simmat.ptr<BEE::SimmatValue>(i) : widened.data();
+            if (!widened.isEmpty())
+                BEE::fromHalf(simmat.ptr<BEE::HalfSimmatValue>(i), widened.data(), simmat.cols);
+            firstGenuineReturns[i] = addRow(scores, mask.row(i, maskRow), simmat.cols);
+        }
+    }
+
+    void merge(const ScoreHistogram &other)
+    {
+        for (int i=0; i<genuines.size(); i++) {
+            genuines[i] += other.genuines[i];
+            impostors[i] += other.impostors[i];
+        }
+        genuineCount += other.genuineCount;
+        impostorCount += other.impostorCount;
+        numNaNs += other.numNaNs;
+        minGenuineScore = std::min(minGenuineScore, other.minGenuineScore);
+        minImpostorScore = std::min(minImpostorScore, other.minImpostorScore);
+    }
+
+    // Thresholds are bin lower edges, so each operating point is exact and only interpolation between them is approximate
+    QList<OperatingPoint> operatingPoints() const
+    {
+        QList<OperatingPoint> operatingPoints;
+        qint64 falsePositives = 0, previousFalsePositives = 0;
+        qint64 truePositives = 0, previousTruePositives = 0;
+        for (int i=genuines.size()-1; i>=0; i--) {
+            truePositives += genuines[i];
+            falsePositives += impostors[i];
+            if ((falsePositives > previousFalsePositives) &&
+                (truePositives > previousTruePositives)) {
+                operatingPoints.append(OperatingPoint(score(i), double(falsePositives)/impostorCount, double(truePositives)/genuineCount));
+                previousFalsePositives = falsePositives;
+                previousTruePositives = truePositives;
+            }
+        }
+
+        if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
+        if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
+        if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
+        return operatingPoints;
+    }
+
+    // Evenly spaced quantiles, highest scores first, each reported as the lower edge of its bin
+    QList<float> sample(bool genuine, int points) const
+    {
+        const QVector<qint64> &counts = genuine ? genuines : impostors;
+        const qint64 total = genuine ? genuineCount : impostorCount;
+        const float minScore = genuine ? minGenuineScore : minImpostorScore;
+        QList<float> samples; samples.reserve(points);
+        qint64 accumulated = 0;
+        int i = counts.size();
+        for (int j=0; j<points; j++) {
+            const qint64 index = double(j) / double(points-1) * double(total-1);
+            while (accumulated <= index)
+                accumulated += counts[--i];
+            const float sample = score(i);
+            samples.append(sample == -std::numeric_limits<float>::max() ? minScore : sample);
+        }
+        return samples;
+    }
+};
+
+static QVector<ScoreHistogram> makeHistograms()
+{
+    const int bits = Globals->evalHistogramBits;
+    if ((bits < 10) || (bits > 24))
+        qFatal("Expected evalHistogramBits in [10, 24], got %d.", bits);
+    return QVector<ScoreHistogram>(Globals->parallelism, ScoreHistogram(bits));
+}
+
+// Splits the rows of a block across the per-thread histograms
+static void accumulateHistograms(QVector<ScoreHistogram> &histograms, const Mat &simmat, const MaskRows &mask, int *firstGenuineReturns)
+{
+    if (simmat.size() != mask.size())
+        qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
+               simmat.rows, simmat.cols, mask.size().height, mask.size().width);
+
+    QFutureSynchronizer<void> futures;
+    for (int t=0; t<histograms.size(); t++) {
+        const int begin = qint64(simmat.rows) * t / histograms.size();
+        const int end = qint64(simmat.rows) * (t+1) / histograms.size();
+        if (begin == end) continue;
+        if (histograms.size() > 1) futures.addFuture(QtConcurrent::run(&histograms[t], &ScoreHistogram::addRows, simmat, mask, begin, end, firstGenuineReturns));
+        else                       histograms[t].addRows(simmat, mask, begin, end, firstGenuineReturns);
+    }
+    futures.waitForFinished();
+}
+
+static float evaluateHistograms(const QVector<ScoreHistogram> &histograms, const QVector<int> &firstGenuineReturns, qint64 rows, qint64 cols,
+                                const QString &csv, const QString &target, unsigned int matches)
+{
+    ScoreHistogram histogram = histograms.first();
+    for (int i=1; i<histograms.size(); i++)
+        histogram.merge(histograms[i]);
+
+    if (histogram.numNaNs > 0) qWarning("Encountered %lld NaN scores!", histogram.numNaNs);
+    if (histogram.genuineCount == 0) qFatal("No genuine scores!");
+    if (histogram.impostorCount == 0) qFatal("No impostor scores!");
+    if (matches != 0) qWarning("Individual matches are not available from histogram evaluation.");
+
+    const QList<OperatingPoint> operatingPoints = histogram.operatingPoints();
+
+    // Write Metadata table
+    QStringList lines;
+    lines.append("Plot,X,Y");
+    lines.append("Metadata,"+QString::number(cols)+",Gallery");
+    lines.append("Metadata,"+QString::number(rows)+",Probe");
+    lines.append("Metadata,"+QString::number(histogram.genuineCount)+",Genuine");
+    lines.append("Metadata,"+QString::number(histogram.impostorCount)+",Impostor");
+    lines.append("Metadata,"+QString::number(cols*rows-(histogram.genuineCount+histogram.impostorCount))+",Ignored");
+
+    const int points = qMin(qMin(qint64(Max_Points), histogram.genuineCount), histogram.impostorCount);
+    QList<float> sampledGenuineScores, sampledImpostorScores;
+    if (points > 1) {
+        sampledGenuineScores = histogram.sample(true, points);
+        sampledImpostorScores = histogram.sample(false, points);
+    }
+
+    const float result = writeEvaluation(lines, operatingPoints, firstGenuineReturns, sampledGenuineScores, sampledImpostorScores, csv, target);
+    qDebug("Histogram TAR @ FAR = 0.01 error bound: +/- %.4f", getTARUncertaintyGivenFAR(operatingPoints, 0.01));
+    return result;
+}
+
+// Bins the similarity matrix and its mask in a single pass of row blocks without holding either in memory
+static float evaluateHistograms(const QString &simmat, const QString &mask, const QString &csv, unsigned int matches)
+{
+    BEE::MatrixReader scores(simmat);
+    QScopedPointer<BEE::MatrixReader> maskReader;
+    MaskRows truth;
+    if (mask.isEmpty()) {
+        if (scores.target.isEmpty()) qFatal("Unspecified target gallery.");
+        if (scores.query.isEmpty()) qFatal("Unspecified query gallery.");
+        truth = constructMatchingMask(Size(scores.cols, scores.rows), TemplateList::fromGallery(scores.target, false).files(),
+                                                                      TemplateList::fromGallery(scores.query, false).files());
+    } else if (mask.endsWith(".mask")) {
+        maskReader.reset(new BEE::MatrixReader(mask));
+        if (!maskReader->isMask) qFatal("Expected a mask matrix.");
+    } else {
+        File maskFile(mask);
+        maskFile.set("rows", scores.rows);
+        maskFile.set("columns", scores.cols);
+        QScopedPointer<Format> format(Factory<Format>::make(maskFile));
+        truth = MaskRows(format->read());
+    }
+
+    QVector<ScoreHistogram> histograms = makeHistograms();
+    QVector<int> firstGenuineReturns(scores.rows, 0);
+    const int blockRows = std::max(1, (1 << 24) / std::max(1, scores.cols));
+    for (int i=0; i<scores.rows; i+=blockRows) {
+        const int count = std::min(blockRows, scores.rows - i);
+        accumulateHistograms(histograms, scores.read(count), maskReader.isNull() ? truth.rowRange(i, i+count) : MaskRows(maskReader->read(count)), firstGenuineReturns.data() + i);
+    }
+
+    return evaluateHistograms(histograms, firstGenuineReturns, scores.rows, scores.cols, csv, scores.target, matches);
+}
+
+static float evaluate(const Mat &simmat, const MaskRows &mask, const QString &csv, const QString &target, const QString &query, unsigned int matches);
+
 float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv, int partition)
 {
-    return Evaluate(scores, constructMatchingMask(scores, target, query, partition), csv, QString(), QString(), 0);
+    return evaluate(scores, constructMatchingMask(scores.size(), target, query, partition), csv, QString(), QString(), 0);
 }
 
 float Evaluate(const QString &simmat, const QString &mask, const QString &csv, unsigned int matches)
@@ -146,58 +510,90 @@ float Evaluate(const QString &simmat, const QString &mask, const QString &csv, u
            mask.isEmpty() ? "" : qPrintable(" with " + mask),
            csv.isEmpty() ? "" : qPrintable(" to " + csv));
 
+    // Bin dense similarity matrices without reading them into memory
+    if ((Globals->evalHistogramBits > 0) && simmat.endsWith(".mtx"))
+        return evaluateHistograms(simmat, mask, csv, matches);
+
     // Read similarity matrix
     QString target, query;
     Mat scores;
-    if (simmat.endsWith(".mtx")) {
-        scores = BEE::readMatrix(simmat, &target, &query);
+    if (simmat.endsWith(".mtx") || simmat.endsWith(".smtx")) {
+        scores = BEE::readMatrix(simmat, &target, &query, true);
     } else {
         QScopedPointer<Format> format(Factory<Format>::make(simmat));
         scores = format->read();
     }
 
     // Read mask matrix
-    Mat truth;
+    MaskRows truth;
     if (mask.isEmpty()) {
         // Use the galleries specified in the similarity matrix
         if (target.isEmpty()) qFatal("Unspecified target gallery.");
         if (query.isEmpty()) qFatal("Unspecified query gallery.");
 
-        truth = constructMatchingMask(scores, TemplateList::fromGallery(target).files(),
-                                              TemplateList::fromGallery(query).files());
+        truth = constructMatchingMask(scores.size(), TemplateList::fromGallery(target, false).files(),
+                                              TemplateList::fromGallery(query, false).files());
     } else {
         File maskFile(mask);
         maskFile.set("rows", scores.rows);
         maskFile.set("columns", scores.cols);
         QScopedPointer<Format> format(Factory<Format>::make(maskFile));
-        truth = format->read();
+        const Mat explicitMask = format->read();
+        if (explicitMask.type() != CV_8UC1)
+            qFatal("Invalid mask format");
+        truth = MaskRows(explicitMask);
     }
 
-    return Evaluate(scores, truth, csv, target, query, matches);
+    return evaluate(scores, truth, csv, target, query, matches);
 }
 
 float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QString &target, const QString &query, unsigned int matches)
+{
+    if (mask.type() != CV_8UC1)
+        qFatal("Invalid mask format");
+    return evaluate(simmat, MaskRows(mask), csv, target, query, matches);
+}
+
+static float evaluate(const Mat &simmat, const MaskRows &mask, const QString &csv, const QString &target, const QString &query, unsigned int matches)
 {
     if (target.isEmpty() || query.isEmpty()) matches = 0;
     if (simmat.size() != mask.size())
         qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
-               simmat.rows, simmat.cols, mask.rows, mask.cols);
+               simmat.rows, simmat.cols, mask.size().height, mask.size().width);
 
-    if (simmat.type() != CV_32FC1)
+    const bool isHalf = simmat.type() == CV_16UC1;
+    if ((simmat.type() != CV_32FC1) && !isHalf)
         qFatal("Invalid simmat format");
 
-    if (mask.type() != CV_8UC1)
-        qFatal("Invalid mask format");
+    if (Globals->evalHistogramBits > 0) {
+        QVector<ScoreHistogram> histograms = makeHistograms();
+        QVector<int> firstGenuineReturns(simmat.rows, 0);
+        accumulateHistograms(histograms, simmat, mask, firstGenuineReturns.data());
+        return evaluateHistograms(histograms, firstGenuineReturns, simmat.rows, simmat.cols, csv, target, matches);
+    }
 
     float result = -1;
 
     // Make comparisons
     QList<Comparison> comparisons; comparisons.reserve(simmat.rows*simmat.cols);
     int genuineCount = 0, impostorCount = 0, numNaNs = 0;
+    QVector<BEE::SimmatValue> halfRow(isHalf ? simmat.cols : 0);
+    QVector<BEE::MaskValue> maskBuffer;
     for (int i=0; i<simmat.rows; i++) {
+        const BEE::MaskValue *maskRow = mask.row(i, maskBuffer);
+
+        // Half precision scores are widened a row at a time, infinities stand in for missing scores
+        const BEE::SimmatValue *row = isHalf ? halfRow.data() : simmat.ptr<BEE::SimmatValue>(i);
+        if (isHalf) {
+            BEE::fromHalf(simmat.ptr<BEE::HalfSimmatValue>(i), halfRow.data(), simmat.cols);
+            for (int j=0; j<simmat.cols; j++)
+                if (fabs(halfRow[j]) == std::numeric_limits<float>::infinity())
+                    halfRow[j] = (halfRow[j] < 0 ? -1 : 1) * std::numeric_limits<float>::max();
+        }
+
         for (int j=0; j<simmat.cols; j++) {
-            const BEE::MaskValue mask_val = mask.at<BEE::MaskValue>(i,j);
-            const BEE::SimmatValue simmat_val = simmat.at<BEE::SimmatValue>(i,j);
+            const BEE::MaskValue mask_val = maskRow[j];
+            const BEE::SimmatValue simmat_val = row[j];
             if (mask_val == BEE::DontCare) continue;
             if (simmat_val != simmat_val) { numNaNs++; continue; }
             Comparison comparison(simmat_val, j, i, mask_val == BEE::Match);
@@ -282,8 +678,8 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QSt
 
     QString filePath = Globals->path;
     if (matches != 0 && EERIndex != 0) {
-        const FileList targetFiles = TemplateList::fromGallery(target).files();
-        const FileList queryFiles = TemplateList::fromGallery(query).files();
+        const FileList targetFiles = TemplateList::fromGallery(target, false).files();
+        const FileList queryFiles = TemplateList::fromGallery(query, false).files();
         unsigned int count = 0;
         for (int i = EERIndex-1; i >= 0; i--) {
             if (!comparisons[i].genuine) {
@@ -302,86 +698,35 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QSt
         }
     }
 
-    // Write Detection Error Tradeoff (DET), PRE, REC
-    float FAR=0.000001;
-    for (int i=0; i<Max_Points; i++) {
-        OperatingPoint operatingPoint = getOperatingPointGivenFAR(operatingPoints, FAR);
-        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
-                                              QString::number(1-operatingPoint.TAR)));
-        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPoint.score),
-                                              QString::number(FAR)));
-        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPoint.score),
-                                              QString::number(1-operatingPoint.TAR)));
-        //multiplier roughly spans 10E-6 to 1
-        FAR *=1.02807;
-    }
-
-    // Write TAR@FAR Table (FT)
-    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
-      lines.append(qPrintable(QString("FT,%1,%2").arg(
-						      QString::number(far, 'f'),
-						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
-
-    // Write FAR@TAR Table (FatT)
-    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
-      lines.append(qPrintable(QString("FatT,%1,%2").arg(
-                         QString::number(tar, 'f', 2),
-                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
-
-    //Write CMC Table (CT)
-    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
-    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
-    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
-    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
-    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
-    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
-
-    // Write FAR/TAR Bar Chart (BC)
-    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
-    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
-
-    // Attempt to read template size from enrolled gallery and write to output CSV
-    size_t maxSize(0);
-    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
-        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
-        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
-    }
-
-    // Write SD & KDE
-    int points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
-    QList<double> sampledGenuineScores; sampledGenuineScores.reserve(points);
-    QList<double> sampledImpostorScores; sampledImpostorScores.reserve(points);
-
+    // Sample the score distributions, highest scores first
+    const int points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
+    QList<float> sampledGenuineScores; sampledGenuineScores.reserve(points);
+    QList<float> sampledImpostorScores; sampledImpostorScores.reserve(points);
     if (points > 1) {
         for (int i=0; i<points; i++) {
             float genuineScore = genuines[double(i) / double(points-1) * double(genuines.size()-1)];
             float impostorScore = impostors[double(i) / double(points-1) * double(impostors.size()-1)];
             if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
             if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
-            lines.append(QString("SD,%1,Genuine").arg(QString::number(genuineScore)));
-            lines.append(QString("SD,%1,Impostor").arg(QString::number(impostorScore)));
             sampledGenuineScores.append(genuineScore);
             sampledImpostorScores.append(impostorScore);
         }
     }
 
-    // Write Cumulative Match Characteristic (CMC) curve
-    const int Max_Retrieval = 200;
-    const int Report_Retrieval = 5;
-    for (int i=1; i<=Max_Retrieval; i++) {
-        const float retrievalRate = getCMC(firstGenuineReturns, i);
-        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+    result = writeEvaluation(lines, operatingPoints, firstGenuineReturns, sampledGenuineScores, sampledImpostorScores, csv, target);
+
+    if (isHalf) {
+        // Genuine scores within half a unit in the last place of the threshold may have rounded to either side of it
+        const float threshold = getOperatingPointGivenFAR(operatingPoints, 0.01).score;
+        int exponent; frexp(threshold, &exponent);
+        const float halfUlp = ldexp(1.f, std::max(exponent, -13) - 12);
+        int ambiguous = 0;
+        foreach (float genuine, genuines)
+            if (fabs(genuine - threshold) <= halfUlp)
+                ambiguous++;
+        qDebug("Half precision TAR @ FAR = 0.01 uncertainty: +/- %.3f", float(ambiguous)/genuineCount);
     }
 
-    QtUtils::writeFile(csv, lines);
-    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
-    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
-    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
-    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
-    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
-
-    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
-
     return result;
 }
 
@@ -396,189 +741,188 @@ void assertEval(const QString &simmat, const QString &mask, float accuracy)
     }
 }
 
-struct GenImpCounts
+// Reads the labels of a gallery without its matrices as dense ids, labels missing from ids are -1 unless inserted
+static QVector<int> readLabelIds(const QString &gallery, QHash<QString,int> &ids, bool insert)
 {
-    GenImpCounts()
-    {
-        genCount = 1;
-        impCount = 0;
-    }
-
-    qint64 genCount;
-    qint64 impCount;
-};
-
-float InplaceEval(const QString &simmat, const QString &target, const QString &query, const QString &csv)
-{
-    qDebug("Evaluating %s%s%s",
-            qPrintable(simmat),
-            qPrintable(" with " + target + " and " + query),
-            csv.isEmpty() ? "" : qPrintable(" to " + csv));
-
-    // To start with, we will find the size of the header, and check if the file size is consistent with the information
-    // given in the header.
-    QFile file(simmat);
-    bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Unable to open %s for reading.", qPrintable(simmat));
-
-    // Check format
-    QByteArray format = file.readLine();
-    if (format[1] != '2') qFatal("Invalid matrix header.");
+    QScopedPointer<Gallery> i(Gallery::make(gallery));
+    i->set_readBlockSize(10000);
 
-    // Read sigset names, we dont' care if they are valid, just want to advance the file pointer.
-    file.readLine();
-    file.readLine();
-
-    // Get matrix size
-    QStringList words = QString(file.readLine()).split(" ");
-    qint64 rows = words[1].toLongLong();
-    qint64 cols = words[2].toLongLong();
-
-    bool isMask = words[0][1] == 'B';
-    qint64 typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-
-    // Get matrix data
-    qint64 rowSize = cols * typeSize;
-
-    // after reading the header, we are at the start of the matrix data
-    qint64 data_pos = file.pos();
-
-    // Map each unique label to a list of positions in the gallery
-    QMap<QString, QList<qint64> > galleryIndices;
-
-    // Next we will find the locations of all genuine scores based on the galleries, we will not instantiate a mask matrix
-    QScopedPointer<Gallery> columnGal(Gallery::make(target));
-    columnGal->set_readBlockSize(10000);
-
-    qint64 idx  = 0;
+    QVector<int> labels;
     bool done = false;
     do {
-        TemplateList temp = columnGal->readBlock(&done);
-        QStringList tempLabels = File::get<QString>(temp, "Label");
-
-        foreach (QString st, tempLabels) {
-            if (!galleryIndices.contains(st))
-                galleryIndices.insert(st, QList<qint64>());
-
-            galleryIndices[st].append(idx);
-            idx++;
+        foreach (const QString &label, File::get<QString>(i->readFiles(&done), "Label")) {
+            if (insert && !ids.contains(label))
+                ids.insert(label, ids.size());
+            labels.append(ids.value(label, -1));
         }
     } while (!done);
+    return labels;
+}
 
-    qint64 genTotal = 0;
-    qint64 imposterTotal = 0;
-
-    // map a genuine score threshold to the set of imposter scores uniquely rejected at that threshold
-    QMap<float, GenImpCounts> genScoresToCounts;
+// Memory mapped similarity matrix and the genuine columns of each row
+struct InplaceMatrix
+{
+    const uchar *data;
+    qint64 cols;
+    bool isHalf, negate;
+    QVector<int> queryLabels;
+    QVector<int> labelOffsets, labelColumns; // Target columns of each label id in compressed sparse row order
 
-    QScopedPointer<Gallery> probeGallery (Gallery::make(query));
-    probeGallery->set_readBlockSize(10000);
-    done = false;
-    qint64 row_count = 0;
-    do {
-        TemplateList temp = probeGallery->readBlock(&done);
-        QStringList probeLabels = File::get<QString>(temp, "Label");
+    float score(qint64 i, qint64 j) const
+    {
+        const float score = isHalf ? BEE::fromHalf(reinterpret_cast<const BEE::HalfSimmatValue*>(data)[i*cols+j])
+                                   : reinterpret_cast<const BEE::SimmatValue*>(data)[i*cols+j];
+        return negate ? -score : score;
+    }
 
-        for (int i=0; i < probeLabels.size();i++) {
-            row_count++;
-            if (!galleryIndices.contains(probeLabels[i]))
-                continue;
+    void row(qint64 i, float *scores) const
+    {
+        if (isHalf) BEE::fromHalf(reinterpret_cast<const BEE::HalfSimmatValue*>(data) + i*cols, scores, cols);
+        else        memcpy(scores, reinterpret_cast<const BEE::SimmatValue*>(data) + i*cols, cols*sizeof(float));
+        if (negate)
+            for (qint64 j=0; j<cols; j++)
+                scores[j] = -scores[j];
+    }
+};
 
-            QList<qint64> colMask = galleryIndices[probeLabels[i]];
-            foreach (qint64 colID, colMask) {
-                float score;
-                file.seek(data_pos + i * rowSize + colID * typeSize);
-                file.read((char *) &score, sizeof(float));
-                if (genScoresToCounts.contains(score))
-                    genScoresToCounts[score].genCount++;
-                else
-                    genScoresToCounts.insert(score, GenImpCounts());
-                genTotal++;
-            }
-        }
+// Partial statistics of a range of rows
+struct InplaceCounts
+{
+    QVector<float> genuines;
+    QVector<qint64> impostors; // Impostor count at each index of the ascending genuine thresholds it falls below
+    qint64 highImpostors; // Impostor count above every genuine score
 
-    } while (!done);
+    InplaceCounts() : highImpostors(0) {}
+};
 
-    QMap<float, GenImpCounts> noImpostors = genScoresToCounts;
+static void inplaceGenuines(const InplaceMatrix *matrix, int begin, int end, InplaceCounts *counts)
+{
+    for (int i=begin; i<end; i++) {
+        const int label = matrix->queryLabels[i];
+        if (label == -1)
+            continue;
+        for (int k=matrix->labelOffsets[label]; k<matrix->labelOffsets[label+1]; k++)
+            counts->genuines.append(matrix->score(i, matrix->labelColumns[k]));
+    }
+}
 
-    imposterTotal = rows * cols - genTotal;
+static void inplaceImpostors(const InplaceMatrix *matrix, const QVector<float> *thresholds, int begin, int end, InplaceCounts *counts)
+{
+    counts->impostors.fill(0, thresholds->size());
+    QVector<float> scores(matrix->cols);
+    for (int i=begin; i<end; i++) {
+        matrix->row(i, scores.data());
+
+        // Genuine columns are ascending, so they are skipped with a moving cursor
+        const int label = matrix->queryLabels[i];
+        int k = (label == -1) ? 0 : matrix->labelOffsets[label];
+        const int genuineEnd = (label == -1) ? 0 : matrix->labelOffsets[label+1];
+        for (int j=0; j<matrix->cols; j++) {
+            if ((k < genuineEnd) && (matrix->labelColumns[k] == j)) {
+                k++;
+                continue;
+            }
 
-    file.seek(data_pos);
-    cv::Mat aRow(1, cols, CV_32FC1);
-    qint64 highImpostors = 0;
+            // The first threshold above this score is the highest threshold at which it is rejected
+            const int index = std::upper_bound(thresholds->begin(), thresholds->end(), scores[j]) - thresholds->begin();
+            if (index == thresholds->size()) counts->highImpostors++;
+            else                             counts->impostors[index]++;
+        }
+    }
+}
 
-    QScopedPointer<Gallery> probeGallery2 (Gallery::make(query));
-    int bSize = 10000;
-    probeGallery2->set_readBlockSize(bSize);
-    done = false;
-    row_count  = 0;
+float InplaceEval(const QString &simmat, const QString &target, const QString &query, const QString &csv)
+{
+    qDebug("Evaluating %s%s%s",
+            qPrintable(simmat),
+            qPrintable(" with " + target + " and " + query),
+            csv.isEmpty() ? "" : qPrintable(" to " + csv));
 
-    //sequence, mapfunciton, reducefunction
-    Mat blockMat(bSize, cols, CV_32FC1);
+    BEE::MatrixReader reader(simmat);
+    if (reader.isMask) qFatal("Expected a similarity matrix.");
+    const qint64 rows = reader.rows;
+    const qint64 cols = reader.cols;
+
+    InplaceMatrix matrix;
+    matrix.data = reader.map();
+    matrix.cols = cols;
+    matrix.isHalf = reader.isHalf;
+    matrix.negate = reader.negate;
+
+    // Label ids index the gallery columns of each label, so no mask matrix is instantiated
+    QHash<QString,int> ids;
+    const QVector<int> targetLabels = readLabelIds(target, ids, true);
+    matrix.queryLabels = readLabelIds(query, ids, false);
+    if ((targetLabels.size() != cols) || (matrix.queryLabels.size() != rows))
+        qFatal("Galleries (%d by %d) differ in size from the similarity matrix (%lld by %lld).",
+               matrix.queryLabels.size(), targetLabels.size(), rows, cols);
+
+    matrix.labelOffsets.fill(0, ids.size()+1);
+    foreach (int label, targetLabels)
+        matrix.labelOffsets[label+1]++;
+    for (int i=0; i<ids.size(); i++)
+        matrix.labelOffsets[i+1] += matrix.labelOffsets[i];
+    matrix.labelColumns.resize(cols);
+    QVector<int> cursor = matrix.labelOffsets;
+    for (int j=0; j<cols; j++)
+        matrix.labelColumns[cursor[targetLabels[j]]++] = j;
+
+    // Each thread accumulates a contiguous range of rows
+    const int threads = std::max(1, std::min(Globals->parallelism, int(rows)));
+    QVector<InplaceCounts> counts(threads);
+    QFutureSynchronizer<void> futures;
+    for (int t=0; t<threads; t++)
+        futures.addFuture(QtConcurrent::run(inplaceGenuines, (const InplaceMatrix*)&matrix, int(rows*t/threads), int(rows*(t+1)/threads), &counts[t]));
+    futures.waitForFinished();
+
+    // Unique genuine scores are the thresholds
+    QVector<float> thresholds;
+    foreach (const InplaceCounts &partial, counts)
+        thresholds += partial.genuines;
+    const qint64 genTotal = thresholds.size();
+    const qint64 imposterTotal = rows * cols - genTotal;
+    std::sort(thresholds.begin(), thresholds.end());
+    QVector<qint64> genuineCounts;
+    genuineCounts.reserve(thresholds.size());
+    int unique = 0;
+    for (int i=0; i<thresholds.size(); i++) {
+        if ((unique > 0) && (thresholds[unique-1] == thresholds[i])) {
+            genuineCounts.last()++;
+        } else {
+            thresholds[unique++] = thresholds[i];
+            genuineCounts.append(1);
+        }
+    }
+    thresholds.resize(unique);
 
-    qint64 bCount = 0;
-    do {
-        bCount++;
-        TemplateList temp = probeGallery2->readBlock(&done);
-        QStringList probeLabels = File::get<QString>(temp, "Label");
-        temp.clear();
-
-        file.read((char *) blockMat.data, rowSize * probeLabels.length());
-        for (int i=0; i < probeLabels.size();i++) {
-            row_count++;
-            aRow = blockMat.row(i);
-
-            QList<qint64> colMask = galleryIndices[probeLabels[i]];
-            int listIdx = 0;
-
-            for (qint64 colIdx = 0; colIdx < cols; colIdx++)
-            {
-                // if our list index is past the end of colMask, we just have impostor scores left
-                if (listIdx < colMask.size() )
-                {
-                    // we hit the next gen score, skip it, and advance listIdx
-                    if (colIdx == colMask[listIdx])
-                    {
-                        listIdx++;
-                        continue;
-                    }
-                }
-                float score = aRow.at<float>(0, colIdx);
-                QMap<float, GenImpCounts>::iterator i = genScoresToCounts.upperBound(score);
-                if (i == genScoresToCounts.end() )
-                {
-                    // no genuine scores >= this impostor score, nothing to do.
-                    highImpostors++;
-                    continue;
-                }
+    futures.clearFutures();
+    for (int t=0; t<threads; t++)
+        futures.addFuture(QtConcurrent::run(inplaceImpostors, (const InplaceMatrix*)&matrix, (const QVector<float>*)&thresholds, int(rows*t/threads), int(rows*(t+1)/threads), &counts[t]));
+    futures.waitForFinished();
 
-                // The iterator points to the first score > this one, i.e. the highest threshold for which this
-                // score will be rejected
-                i->impCount++;
-            }
-        }
-    } while (!done);
+    QVector<qint64> impostorCounts(thresholds.size(), 0);
+    qint64 highImpostors = 0;
+    foreach (const InplaceCounts &partial, counts) {
+        for (int i=0; i<thresholds.size(); i++)
+            impostorCounts[i] += partial.impostors[i];
+        highImpostors += partial.highImpostors;
+    }
 
     QList<OperatingPoint> operatingPoints;
     qint64 genAccum = 0;
     qint64 impAccum = highImpostors;
 
-    QMapIterator<float, GenImpCounts> i(genScoresToCounts);
-    
-    i.toBack();
-   
     // iterating in reverse order of thresholds
-    while (i.hasPrevious()) {
-        i.previous();
+    for (int i=thresholds.size()-1; i>=0; i--) {
         // we want to accumulate false accept, true accept points
-        float thresh = i.key();
+        const float thresh = thresholds[i];
         // genAccum -- number of gen scores at this threshold and above
-        genAccum += i.value().genCount;
+        genAccum += genuineCounts[i];
 
         operatingPoints.append(OperatingPoint(thresh, float(impAccum) / float(imposterTotal), float(genAccum) / float(genTotal)));
 
         // imp count -- number of impostor scores at this threshold and above
-        impAccum += i.value().impCount;
+        impAccum += impostorCounts[i];
     }
 
     QStringList lines;
@@ -720,7 +1064,12 @@ struct SortedDetection
     SortedDetection() : truth_idx(-1), predicted_idx(-1), overlap(-1) {}
     SortedDetection(int truth_idx_, int predicted_idx_, float overlap_)
         : truth_idx(truth_idx_), predicted_idx(predicted_idx_), overlap(overlap_) {}
-    inline bool operator<(const SortedDetection &other) const { return overlap > other.overlap; }
+    inline bool operator<(const SortedDetection &other) const
+    {
+        if (overlap != other.overlap)      return overlap > other.overlap;
+        else if (truth_idx != other.truth_idx) return truth_idx < other.truth_idx; // Ties resolve in truth, then prediction order
+        else                               return predicted_idx < other.predicted_idx;
+    }
 };
 
 struct Detections
@@ -860,29 +1209,74 @@ static QList<Detection> getDetections(const DetectionKey &key, const File &f, bo
     return dets;
 }
 
-static QMap<QString, Detections> getDetections(const File &predictedGallery, const File &truthGallery)
+static void addDetections(const FileList &files, bool isTruth, QMap<QString, Detections> &allDetections, DetectionKey &key)
 {
-    const FileList predicted = TemplateList::fromGallery(predictedGallery).files();
-    const FileList truth = TemplateList::fromGallery(truthGallery).files();
+    if (files.isEmpty())
+        return;
 
     // Figure out which metadata field contains a bounding box
-    DetectionKey truthDetectKey = getDetectKey(truth);
+    if (key.isEmpty()) {
+        key = getDetectKey(files);
+        if (key.isEmpty())
+            qFatal("No suitable %s metadata key found.", isTruth ? "ground truth" : "predicted");
+    }
+
+    foreach (const File &f, files) {
+        if (isTruth)                           allDetections[f.name].truth.append(getDetections(key, f, true));
+        else if (allDetections.contains(f.name)) allDetections[f.name].predicted.append(getDetections(key, f, false));
+    }
+}
+
+// Whether the file at index of a gallery is kept by its pos, length and step arguments, as in TemplateList::fromGallery()
+static bool isSelected(const File &gallery, int index)
+{
+    const int offset = index - gallery.get<int>("pos", 0);
+    const int length = gallery.get<int>("length", -1);
+    return (offset >= 0) && ((length < 0) || (offset < length)) && (offset % std::max(1, gallery.get<int>("step", 1)) == 0);
+}
+
+// Reads a gallery a block at a time so that only the boxes of each image are held in memory.
+// Files are selected like TemplateList::fromGallery() selects them, reduced galleries are read whole.
+static void readDetections(const File &gallery, bool isTruth, QMap<QString, Detections> &allDetections, DetectionKey &key)
+{
+    if (gallery.getBool("reduce")) {
+        addDetections(TemplateList::fromGallery(gallery, false).files(), isTruth, allDetections, key);
+        return;
+    }
+
+    foreach (const File &file, gallery.split()) {
+        QScopedPointer<Gallery> i(Gallery::make(file));
+        i->set_readBlockSize(10000);
+        bool done = false;
+        int index = 0;
+        do {
+            FileList files;
+            foreach (const File &f, i->readFiles(&done))
+                if (isSelected(gallery, index++))
+                    files.append(f);
+            addDetections(files, isTruth, allDetections, key);
+        } while (!done);
+
+        // If file is a Format not a Gallery (e.g. XML Format vs. XML Gallery)
+        if ((index == 0) && isSelected(gallery, 0))
+            addDetections(FileList() << file, isTruth, allDetections, key);
+    }
+}
+
+static QMap<QString, Detections> getDetections(const File &predictedGallery, const File &truthGallery)
+{
+    QMap<QString, Detections> allDetections;
+    DetectionKey truthDetectKey, predictedDetectKey;
+    readDetections(truthGallery, true, allDetections, truthDetectKey);
     if (truthDetectKey.isEmpty())
         qFatal("No suitable ground truth metadata key found.");
-
-    DetectionKey predictedDetectKey = getDetectKey(predicted);
+    readDetections(predictedGallery, false, allDetections, predictedDetectKey);
     if (predictedDetectKey.isEmpty())
         qFatal("No suitable predicted metadata key found.");
 
     qDebug("Using metadata key: %s%s",
            qPrintable(predictedDetectKey),
            qPrintable(predictedDetectKey == truthDetectKey ? QString() : "/"+truthDetectKey));
-
-    QMap<QString, Detections> allDetections;
-    foreach (const File &f, truth)
-        allDetections[f.name].truth.append(getDetections(truthDetectKey, f, true));
-    foreach (const File &f, predicted)
-        if (allDetections.contains(f.name)) allDetections[f.name].predicted.append(getDetections(predictedDetectKey, f, false));
     return allDetections;
 }
 
@@ -891,66 +1285,165 @@ static inline int getNumberOfImages(const QMap<QString, Detections> detections)
     return detections.keys().size();
 }
 
-static int associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+// Uniform grid over the ground truth boxes of an image, cells list the boxes that intersect them
+class DetectionGrid
 {
-    float dLeftTotal = 0.0, dRightTotal = 0.0, dTopTotal = 0.0, dBottomTotal = 0.0;
-    int count = 0, totalTrueDetections = 0;
+    QRectF bounds;
+    qreal cellWidth, cellHeight;
+    int columns, rows;
+    QVector< QVector<int> > cells;
 
-    foreach (Detections detections, all.values()) {
-        totalTrueDetections += detections.truth.size();
-        // Try to associate ground truth detections with predicted detections
-
-        QList<SortedDetection> sortedDetections; sortedDetections.reserve(detections.truth.size() * detections.predicted.size());
-        for (int t = 0; t < detections.truth.size(); t++) {
-            const Detection truth = detections.truth[t];
-            for (int p = 0; p < detections.predicted.size(); p++) {
-                Detection predicted = detections.predicted[p];
-
-                float predictedWidth = predicted.boundingBox.width();
-                float x, y, width, height;
-                x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
-                y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
-                width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
-                height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
-                Detection newPredicted(QRectF(x, y, width, height), 0.0);
-
-                const float overlap = truth.overlap(newPredicted);
-                if (overlap > 0)
-                    sortedDetections.append(SortedDetection(t, p, overlap));
-            }
+    int column(qreal x) const { return qBound(0, int((x - bounds.left()) / cellWidth), columns-1); }
+    int row(qreal y) const { return qBound(0, int((y - bounds.top()) / cellHeight), rows-1); }
+
+public:
+    static const int MaxCells = 64; // Per side
+
+    DetectionGrid(const QList<Detection> &truth)
+        : columns(0), rows(0)
+    {
+        if (truth.isEmpty())
+            return;
+
+        // Cells about the size of an average box
+        qreal totalWidth = 0, totalHeight = 0;
+        foreach (const Detection &detection, truth) {
+            bounds |= detection.boundingBox;
+            totalWidth += detection.boundingBox.width();
+            totalHeight += detection.boundingBox.height();
+        }
+        if (bounds.isEmpty())
+            return;
+        cellWidth = std::max(totalWidth / truth.size(), bounds.width() / MaxCells);
+        cellHeight = std::max(totalHeight / truth.size(), bounds.height() / MaxCells);
+        columns = std::min(MaxCells, int(ceil(bounds.width() / cellWidth)));
+        rows = std::min(MaxCells, int(ceil(bounds.height() / cellHeight)));
+
+        cells.resize(columns * rows);
+        for (int t=0; t<truth.size(); t++) {
+            const QRectF &box = truth[t].boundingBox;
+            for (int r=row(box.top()); r<=row(box.bottom()); r++)
+                for (int c=column(box.left()); c<=column(box.right()); c++)
+                    cells[r*columns + c].append(t);
         }
+    }
 
-        std::sort(sortedDetections.begin(), sortedDetections.end());
+    // Appends the boxes sharing a cell with the query, a superset of those that intersect it, each once
+    void candidates(const QRectF &query, QVector<int> &stamps, int stamp, QVector<int> &result) const
+    {
+        const QRectF box = query.normalized();
+        if ((columns == 0) || !box.intersects(bounds))
+            return;
+        for (int r=row(box.top()); r<=row(box.bottom()); r++)
+            for (int c=column(box.left()); c<=column(box.right()); c++)
+                foreach (int t, cells[r*columns + c])
+                    if (stamps[t] != stamp) {
+                        stamps[t] = stamp;
+                        result.append(t);
+                    }
+    }
+};
 
-        QList<int> removedTruth;
-        QList<int> removedPredicted;
+// Association of one image, merged in image order
+struct DetectionAssociation
+{
+    QList<ResolvedDetection> resolved, falseNegative;
+    QList<QRectF> differences; // Left, top, right and bottom differences of well overlapping pairs as x, y, width and height
+    int totalTrueDetections;
+    DetectionAssociation() : totalTrueDetections(0) {}
+};
 
-        foreach (const SortedDetection &detection, sortedDetections) {
-            if (removedTruth.contains(detection.truth_idx) || removedPredicted.contains(detection.predicted_idx))
-                continue;
+static void associateImage(const Detections &detections, const QRectF &offsets, DetectionAssociation &association)
+{
+    association.totalTrueDetections += detections.truth.size();
+    // Try to associate ground truth detections with predicted detections
+    const DetectionGrid grid(detections.truth);
+    QVector<int> stamps(detections.truth.size(), -1), candidates;
+
+    QList<SortedDetection> sortedDetections;
+    for (int p = 0; p < detections.predicted.size(); p++) {
+        Detection predicted = detections.predicted[p];
+
+        float predictedWidth = predicted.boundingBox.width();
+        float x, y, width, height;
+        x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
+        y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
+        width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
+        height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
+        Detection newPredicted(QRectF(x, y, width, height), 0.0);
+
+        candidates.clear();
+        grid.candidates(newPredicted.boundingBox, stamps, p, candidates);
+        foreach (int t, candidates) {
+            const float overlap = detections.truth[t].overlap(newPredicted);
+            if (overlap > 0)
+                sortedDetections.append(SortedDetection(t, p, overlap));
+        }
+    }
 
-            const Detection truth = detections.truth[detection.truth_idx];
-            const Detection predicted = detections.predicted[detection.predicted_idx];
+    std::sort(sortedDetections.begin(), sortedDetections.end());
 
-            if (!truth.ignore) resolved.append(ResolvedDetection(predicted.confidence, detection.overlap));
+    QVector<bool> removedTruth(detections.truth.size(), false);
+    QVector<bool> removedPredicted(detections.predicted.size(), false);
 
-            removedTruth.append(detection.truth_idx);
-            removedPredicted.append(detection.predicted_idx);
+    foreach (const SortedDetection &detection, sortedDetections) {
+        if (removedTruth[detection.truth_idx] || removedPredicted[detection.predicted_idx])
+            continue;
 
-            if (offsets.x() == 0 && detection.overlap > 0.3) {
-                count++;
-                float width = predicted.boundingBox.width();
-                dLeftTotal += (truth.boundingBox.left() - predicted.boundingBox.left()) / width;
-                dRightTotal += (truth.boundingBox.right() - predicted.boundingBox.right()) / width;
-                dTopTotal += (truth.boundingBox.top() - predicted.boundingBox.top()) / width;
-                dBottomTotal += (truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width;
-            }
+        const Detection truth = detections.truth[detection.truth_idx];
+        const Detection predicted = detections.predicted[detection.predicted_idx];
+
+        if (!truth.ignore) association.resolved.append(ResolvedDetection(predicted.confidence, detection.overlap));
+
+        removedTruth[detection.truth_idx] = true;
+        removedPredicted[detection.predicted_idx] = true;
+
+        if (offsets.x() == 0 && detection.overlap > 0.3) {
+            float width = predicted.boundingBox.width();
+            association.differences.append(QRectF((truth.boundingBox.left() - predicted.boundingBox.left()) / width,
+                                                  (truth.boundingBox.top() - predicted.boundingBox.top()) / width,
+                                                  (truth.boundingBox.right() - predicted.boundingBox.right()) / width,
+                                                  (truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width));
         }
+    }
 
-        for (int i = 0; i < detections.predicted.size(); i++)
-            if (!removedPredicted.contains(i)) resolved.append(ResolvedDetection(detections.predicted[i].confidence, 0));
-        for (int i = 0; i < detections.truth.size(); i++)
-            if (!removedTruth.contains(i) && !detections.truth[i].ignore) falseNegative.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
+    for (int i = 0; i < detections.predicted.size(); i++)
+        if (!removedPredicted[i]) association.resolved.append(ResolvedDetection(detections.predicted[i].confidence, 0));
+    for (int i = 0; i < detections.truth.size(); i++)
+        if (!removedTruth[i] && !detections.truth[i].ignore) association.falseNegative.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
+}
+
+static void associateImages(const QList<Detections> *images, const QRectF *offsets, int begin, int end, QVector<DetectionAssociation> *associations)
+{
+    for (int i=begin; i<end; i++)
+        associateImage(images->at(i), *offsets, (*associations)[i]);
+}
+
+static int associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+{
+    float dLeftTotal = 0.0, dRightTotal = 0.0, dTopTotal = 0.0, dBottomTotal = 0.0;
+    int count = 0, totalTrueDetections = 0;
+
+    // Images are associated independently in parallel
+    const QList<Detections> images = all.values();
+    QVector<DetectionAssociation> associations(images.size());
+    const int threads = std::max(1, std::min(Globals->parallelism, images.size()));
+    QFutureSynchronizer<void> futures;
+    for (int t=0; t<threads; t++)
+        futures.addFuture(QtConcurrent::run(associateImages, &images, (const QRectF*)&offsets, images.size()*t/threads, images.size()*(t+1)/threads, &associations));
+    futures.waitForFinished();
+
+    foreach (const DetectionAssociation &association, associations) {
+        totalTrueDetections += association.totalTrueDetections;
+        resolved.append(association.resolved);
+        falseNegative.append(association.falseNegative);
+        foreach (const QRectF &difference, association.differences) {
+            count++;
+            dLeftTotal += difference.x();
+            dRightTotal += difference.width();
+            dTopTotal += difference.y();
+            dBottomTotal += difference.height();
+        }
     }
 
     if (offsets.x() == 0) {
@@ -14,8 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
 #include <QList>
 #include <QStringList>
+#include <QtConcurrentRun>
 #include "openbr/core/opencvutils.h"
 #include <limits>
 #include <vector>
@@ -28,38 +30,74 @@
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+// Population statistics of the scores a mask doesn't ignore, mergeable across row bands
+struct ScoreStatistics
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
+    qint64 count;
+    double mean, m2;
+    float min, max;
 
-    if (method == "None") return;
+    ScoreStatistics()
+        : count(0), mean(0), m2(0), min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+    void add(float val)
+    {
+        count++;
+        const double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+        if (val < min) min = val;
+        if (val > max) max = val;
+    }
 
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
+    void merge(const ScoreStatistics &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * double(count) * other.count / total;
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    double stddev() const { return count == 0 ? 0 : sqrt(m2 / count); }
+};
+
+// Sentinel scores, including the infinities and NaN, carry no magnitude and are kept out of the statistics
+static inline bool isSentinel(float val)
+{
+    return !((val > -std::numeric_limits<float>::max()) && (val < std::numeric_limits<float>::max()));
+}
+
+static void accumulateStatistics(const Mat &matrix, const Mat &mask, ScoreStatistics &statistics)
+{
     for (int i=0; i<matrix.rows; i++) {
         for (int j=0; j<matrix.cols; j++) {
             float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
+            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) || isSentinel(val))
                 continue;
-            vals.append(val);
+            statistics.add(val);
         }
     }
+}
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
+static void normalizeMatrix(Mat &matrix, const Mat &mask, const ScoreStatistics &statistics, const QString &method)
+{
+    if (method == "None") return;
+
+    const float min = statistics.min, max = statistics.max;
+    const double mean = statistics.mean, stddev = statistics.stddev();
 
     if (method == "MinMax") {
         for (int i=0; i<matrix.rows; i++) {
             for (int j=0; j<matrix.cols; j++) {
                 if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
                 float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = 0;
-                else if (val ==  std::numeric_limits<float>::max()) val = 1;
-                else                                                     val = (val - min) / (max - min);
+                if      (val >= std::numeric_limits<float>::max()) val = 1;
+                else if (isSentinel(val))                           val = 0;
+                else                                                val = (val - min) / (max - min);
             }
         }
     } else if (method == "ZScore") {
@@ -68,8 +106,8 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
             for (int j=0; j<matrix.cols; j++) {
                 if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
                 float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = (min - mean) / stddev;
-                else if (val ==  std::numeric_limits<float>::max()) val = (max - mean) / stddev;
+                if      (val >= std::numeric_limits<float>::max()) val = (max - mean) / stddev;
+                else if (isSentinel(val))                           val = (min - mean) / stddev;
                 else                                                val = (val - mean) / stddev;
             }
         }
@@ -78,57 +116,37 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
     }
 }
 
-void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
+/*!
+ * Fuses similarity matrices a band of rows at a time.
+ * The first pass gathers the normalization statistics of every partition and matrix,
+ * the second normalizes, fuses and accumulates each band across partitions before writing it.
+ */
+class Fuser
 {
-    qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
+    QString normalization, fusion;
+    QList<float> weights;
+    QList<BEE::ImplicitMask> masks; // One per cross validation partition
 
-    QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
-    foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMatrix(simmat,&target,&query));
-        // Make we're fusing score matrices for the same set of targets and querys
-        if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
-            qFatal("Target or query files are not the same across fused matrices.");
-        previousTarget = target; previousQuery = query;
-    }
+public:
+    QVector<ScoreStatistics> statistics; // Indexed by partition then matrix
+    int matrices;
+
+    Fuser(const QString &normalization, const QString &fusion, int matrices, const FileList &targetFiles, const FileList &queryFiles)
+        : normalization(normalization), fusion(fusion), matrices(matrices)
+    {
+        if ((matrices < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+        if ((matrices > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+        if ((normalization != "None") && (normalization != "MinMax") && (normalization != "ZScore"))
+            qFatal("Invalid normalization method %s.", qPrintable(normalization));
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
-
-    const FileList targetFiles = TemplateList::fromGallery(target).files();
-    const FileList queryFiles = TemplateList::fromGallery(query).files();
-
-    int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
-    do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
+        if (fusion.startsWith("Sum")) {
             QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
             if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
+                for (int k=0; k<matrices; k++)
                     weights.append(1);
-            } else if (words.size() == matrices.size()) {
+            } else if (words.size() == matrices) {
                 bool ok;
-                for (int k=0; k<matrices.size(); k++) {
+                for (int k=0; k<matrices; k++) {
                     float weight = words[k].toFloat(&ok);
                     if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
                     weights.append(weight);
@@ -136,32 +154,149 @@ void br::Fuse(const QStringList &inputSimmats, const QString &normalization, con
             } else {
                 qFatal("Number of weights does not match number of similarity matrices.");
             }
-
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
-        } else {
+        } else if ((fusion == "Replace") || (fusion == "Difference")) {
+            if (matrices != 2) qFatal("%s fusion requires exactly two matrices.", qPrintable(fusion));
+        } else if ((fusion != "Max") && (fusion != "Min") && (fusion != "None")) {
             qFatal("Invalid fusion method %s.", qPrintable(fusion));
         }
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
+        const int partitions = std::max(1, Globals->crossValidate);
+        for (int partition=0; partition<partitions; partition++)
+            masks.append(BEE::ImplicitMask(targetFiles, queryFiles, partition));
+        statistics.resize(partitions * matrices);
+    }
 
-        add(buffer,fused,buffer,buffer_mask);
+    int partitions() const { return masks.size(); }
 
-        partition++;
+    // Statistics of the band starting at rowOffset, one per partition and matrix
+    void accumulate(const QList<Mat> &band, int rowOffset, QVector<ScoreStatistics> *partial) const
+    {
+        partial->fill(ScoreStatistics(), statistics.size());
+        for (int partition=0; partition<partitions(); partition++) {
+            const Mat mask = bandMask(partition, rowOffset, band.first());
+            for (int i=0; i<matrices; i++)
+                accumulateStatistics(band[i], mask, (*partial)[partition*matrices + i]);
+        }
+    }
 
-    } while (partition < crossValidate);
+    // Accumulates the fused scores of every partition into the output band
+    void fuse(const QList<Mat> &band, int rowOffset, Mat output) const
+    {
+        output.setTo(0);
+        for (int partition=0; partition<partitions(); partition++) {
+            const Mat matrix_mask = bandMask(partition, rowOffset, band.first());
 
-    BEE::writeMatrix(buffer, outputSimmat);
+            QList<Mat> matrices;
+            for (int i=0; i<band.size(); i++) {
+                matrices.append(band[i].clone());
+                normalizeMatrix(matrices[i], matrix_mask, statistics[partition*this->matrices + i], normalization);
+            }
+
+            Mat fused;
+            if (fusion == "Max") {
+                max(matrices[0], matrices[1], fused);
+                for (int i=2; i<matrices.size(); i++)
+                    max(fused, matrices[i], fused);
+            } else if (fusion == "Min") {
+                min(matrices[0], matrices[1], fused);
+                for (int i=2; i<matrices.size(); i++)
+                    min(fused, matrices[i], fused);
+            } else if (fusion.startsWith("Sum")) {
+                addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
+                for (int i=2; i<matrices.size(); i++)
+                    addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
+            } else if (fusion == "Replace") {
+                fused = matrices.first().clone();
+                matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
+            } else if (fusion == "Difference") {
+                subtract(matrices[0], matrices[1], fused);
+            } else {
+                fused = matrices[0];
+            }
+
+            // We don't want to add scores where the mask says we shouldn't care
+            add(output, fused, output, matrix_mask != BEE::DontCare);
+        }
+    }
+
+private:
+    // Pairwise matrices use the leading columns of the mask
+    Mat bandMask(int partition, int rowOffset, const Mat &band) const
+    {
+        const BEE::ImplicitMask &mask = masks[partition];
+        Mat result(band.rows, mask.cols(), CV_8UC1);
+        for (int i=0; i<band.rows; i++)
+            mask.row(rowOffset+i, result.ptr<BEE::MaskValue>(i));
+        return result.colRange(0, band.cols);
+    }
+};
+
+// Rows [begin, end) of each matrix in a band
+static QList<Mat> rowRange(const QList<Mat> &band, int begin, int end)
+{
+    QList<Mat> result;
+    foreach (const Mat &m, band)
+        result.append(m.rowRange(begin, end));
+    return result;
+}
+
+void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
+{
+    qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
+
+    // Make sure we're fusing score matrices for the same set of targets and querys
+    QString target, query;
+    int rows = 0, cols = 0;
+    foreach (const QString &simmat, inputSimmats) {
+        const BEE::MatrixReader reader(simmat);
+        if (!target.isEmpty() && !query.isEmpty() && (reader.target != target || reader.query != query))
+            qFatal("Target or query files are not the same across fused matrices.");
+        if ((rows != 0) && ((reader.rows != rows) || (reader.cols != cols)))
+            qFatal("Similarity matrices differ in size.");
+        target = reader.target; query = reader.query;
+        rows = reader.rows; cols = reader.cols;
+    }
+
+    const FileList targetFiles = TemplateList::fromGallery(target, false).files();
+    const FileList queryFiles = TemplateList::fromGallery(query, false).files();
+    if ((queryFiles.size() != rows) || (targetFiles.size() < cols))
+        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", rows, cols, queryFiles.size(), targetFiles.size());
+    Fuser fuser(normalization, fusion, inputSimmats.size(), targetFiles, queryFiles);
+
+    const int bandRows = std::max(1, (1 << 24) / std::max(1, cols));
+    const int threads = std::max(1, Globals->parallelism);
+
+    for (int pass=(normalization == "None" ? 1 : 0); pass<2; pass++) {
+        QList< QSharedPointer<BEE::MatrixReader> > readers;
+        foreach (const QString &simmat, inputSimmats)
+            readers.append(QSharedPointer<BEE::MatrixReader>(new BEE::MatrixReader(simmat)));
+        QScopedPointer<BEE::MatrixWriter> writer(pass == 1 ? new BEE::MatrixWriter(outputSimmat, rows, cols, CV_32FC1) : NULL);
+
+        for (int i=0; i<rows; i+=bandRows) {
+            const int count = std::min(bandRows, rows - i);
+            QList<Mat> band;
+            foreach (const QSharedPointer<BEE::MatrixReader> &reader, readers)
+                band.append(reader->read(count));
+            Mat output(count, cols, CV_32FC1);
+            QVector< QVector<ScoreStatistics> > partials(threads);
+
+            // Threads take contiguous rows of the band
+            QFutureSynchronizer<void> futures;
+            for (int t=0; t<threads; t++) {
+                const int begin = count*t/threads, end = count*(t+1)/threads;
+                if (begin == end) continue;
+                if (pass == 0) futures.addFuture(QtConcurrent::run(&fuser, &Fuser::accumulate, rowRange(band, begin, end), i+begin, &partials[t]));
+                else           futures.addFuture(QtConcurrent::run(&fuser, &Fuser::fuse, rowRange(band, begin, end), i+begin, output.rowRange(begin, end)));
+            }
+            futures.waitForFinished();
+
+            if (pass == 0) {
+                foreach (const QVector<ScoreStatistics> &partial, partials)
+                    for (int k=0; k<partial.size(); k++)
+                        fuser.statistics[k].merge(partial[k]);
+            } else {
+                writer->write(output);
+            }
+        }
+    }
 }
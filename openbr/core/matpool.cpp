@@ -0,0 +1,255 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QThreadStorage>
+#include <QVector>
+
+#include "openbr/openbr_plugin.h"
+#include "openbr/core/matpool.h"
+
+using namespace cv;
+
+namespace
+{
+
+const int MinClass = 6; // 64 bytes
+const int MaxClass = 26; // 64 megabytes
+const qint64 ClassBudget = 16 << 20; // Bytes a thread keeps free in each class, at least one block
+const qint64 ArenaBudget = 64 << 20; // Bytes a thread keeps free in total
+const qint64 PoolBudget = qint64(256) << 20; // Bytes all threads keep free in total
+const qint64 TrimInterval = 1000; // Milliseconds between trims of the blocks an arena didn't reuse
+
+// Precedes the matrix data in each block, 16 bytes to keep the data aligned
+struct Header
+{
+    qint64 bytes;
+    int sizeClass; // -1 for blocks larger than the largest class
+    int refcount;
+};
+
+struct Counters
+{
+    QAtomicInteger<qint64> allocations, reused, large, returned, freed, trimmed, heldBytes, peakBytes, pooledBytes;
+
+    void hold(qint64 bytes)
+    {
+        const qint64 held = heldBytes.fetchAndAddRelaxed(bytes) + bytes;
+        qint64 peak = peakBytes.load();
+        while ((held > peak) && !peakBytes.testAndSetRelaxed(peak, held))
+            peak = peakBytes.load();
+    }
+};
+
+Counters counters;
+
+// Free blocks by size class, only touched by the thread owning it
+class Arena
+{
+    QVector<uchar*> blocks[MaxClass+1]; // Oldest first
+    int lowWater[MaxClass+1]; // Fewest blocks cached in each class since the last trim
+    qint64 cachedBytes;
+    QElapsedTimer sinceTrim;
+
+    // Frees the first count blocks of a class
+    void drop(int sizeClass, int count)
+    {
+        for (int i=0; i<count; i++) {
+            counters.pooledBytes.fetchAndAddRelaxed(-(qint64(1) << sizeClass));
+            counters.hold(-(qint64(1) << sizeClass));
+            fastFree(blocks[sizeClass][i]);
+        }
+        blocks[sizeClass].remove(0, count);
+        cachedBytes -= qint64(count) << sizeClass;
+    }
+
+    // Blocks that stayed cached for a whole interval weren't needed, typically those freed here but allocated
+    // on another thread, or left over from an earlier workload, so give them back to the system
+    void trim()
+    {
+        for (int i=MinClass; i<=MaxClass; i++) {
+            if (lowWater[i] > 0) {
+                counters.trimmed.fetchAndAddRelaxed(lowWater[i]);
+                drop(i, lowWater[i]);
+            }
+            lowWater[i] = blocks[i].size();
+        }
+        sinceTrim.restart();
+    }
+
+    void maybeTrim()
+    {
+        if (sinceTrim.elapsed() >= TrimInterval)
+            trim();
+    }
+
+public:
+    Arena()
+        : cachedBytes(0)
+    {
+        for (int i=0; i<=MaxClass; i++)
+            lowWater[i] = 0;
+        sinceTrim.start();
+    }
+
+    ~Arena()
+    {
+        for (int i=MinClass; i<=MaxClass; i++)
+            drop(i, blocks[i].size());
+    }
+
+    uchar *take(int sizeClass)
+    {
+        maybeTrim();
+        QVector<uchar*> &cached = blocks[sizeClass];
+        if (cached.isEmpty())
+            return NULL;
+        uchar *block = cached.last();
+        cached.removeLast();
+        lowWater[sizeClass] = std::min(lowWater[sizeClass], cached.size());
+        cachedBytes -= qint64(1) << sizeClass;
+        counters.pooledBytes.fetchAndAddRelaxed(-(qint64(1) << sizeClass));
+        return block;
+    }
+
+    bool give(uchar *block, int sizeClass)
+    {
+        maybeTrim();
+        const qint64 bytes = qint64(1) << sizeClass;
+        QVector<uchar*> &cached = blocks[sizeClass];
+        if (!cached.isEmpty() && ((qint64(cached.size()) + 1) << sizeClass) > ClassBudget)
+            return false;
+        if (cachedBytes + bytes > ArenaBudget)
+            return false;
+        if (counters.pooledBytes.fetchAndAddRelaxed(bytes) + bytes > PoolBudget) {
+            counters.pooledBytes.fetchAndAddRelaxed(-bytes);
+            return false;
+        }
+        cached.append(block);
+        cachedBytes += bytes;
+        return true;
+    }
+};
+
+// Never deleted, pooled matrices may be released during static destruction.
+// An arena is freed with its thread, so idle QThreadPool threads release theirs when they expire.
+QThreadStorage<Arena*> *arenas = new QThreadStorage<Arena*>();
+
+Arena *localArena()
+{
+    if (!arenas->hasLocalData())
+        arenas->setLocalData(new Arena());
+    return arenas->localData();
+}
+
+uchar *acquire(size_t bytes)
+{
+    counters.allocations.ref();
+
+    int sizeClass = MinClass;
+    while ((sizeClass <= MaxClass) && ((size_t(1) << sizeClass) < bytes))
+        sizeClass++;
+
+    uchar *block;
+    if (sizeClass > MaxClass) {
+        counters.large.ref();
+        block = (uchar*) fastMalloc(bytes);
+        ((Header*)block)->bytes = bytes;
+        sizeClass = -1;
+        counters.hold(bytes);
+    } else {
+        block = localArena()->take(sizeClass);
+        if (block) {
+            counters.reused.ref();
+        } else {
+            block = (uchar*) fastMalloc(size_t(1) << sizeClass);
+            ((Header*)block)->bytes = qint64(1) << sizeClass;
+            counters.hold(qint64(1) << sizeClass);
+        }
+    }
+
+    ((Header*)block)->sizeClass = sizeClass;
+    return block;
+}
+
+void release(uchar *block)
+{
+    const Header *header = (const Header*) block;
+    if ((header->sizeClass >= 0) && localArena()->give(block, header->sizeClass)) {
+        counters.returned.ref();
+        return;
+    }
+
+    counters.freed.ref();
+    counters.hold(-header->bytes);
+    fastFree(block);
+}
+
+class PoolAllocator : public MatAllocator
+{
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; i--) {
+            step[i] = total;
+            total *= sizes[i];
+        }
+
+        uchar *block = acquire(sizeof(Header) + total);
+        Header *header = (Header*) block;
+        header->refcount = 1;
+        refcount = &header->refcount;
+        datastart = data = block + sizeof(Header);
+    }
+
+    void deallocate(int *refcount, uchar *datastart, uchar *data)
+    {
+        (void) refcount; (void) data;
+        release(datastart - sizeof(Header));
+    }
+};
+
+} // namespace
+
+MatAllocator *MatPool::allocator()
+{
+    // Never deleted, for the same reason as the arenas
+    static PoolAllocator *pool = new PoolAllocator();
+    return (Globals && Globals->matrixPool) ? pool : NULL;
+}
+
+Mat MatPool::mat()
+{
+    Mat m;
+    m.allocator = allocator();
+    return m;
+}
+
+QString MatPool::statistics()
+{
+    const qint64 allocations = counters.allocations.load();
+    return QString("Matrix pool: %1 allocations, %2% reused, %3 large, %4 returned to the pool, %5 freed, %6 trimmed, %7 MB held, %8 MB peak, %9 MB pooled")
+            .arg(QString::number(allocations),
+                 QString::number(allocations == 0 ? 0 : 100.0 * counters.reused.load() / allocations, 'f', 1),
+                 QString::number(counters.large.load()),
+                 QString::number(counters.returned.load()),
+                 QString::number(counters.freed.load()),
+                 QString::number(counters.trimmed.load()),
+                 QString::number(counters.heldBytes.load() / double(1 << 20), 'f', 1),
+                 QString::number(counters.peakBytes.load() / double(1 << 20), 'f', 1),
+                 QString::number(counters.pooledBytes.load() / double(1 << 20), 'f', 1));
+}
@@ -0,0 +1,42 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef MATPOOL_H
+#define MATPOOL_H
+
+#include <QString>
+#include <opencv2/core/core.hpp>
+
+/*!
+ * Recycles matrix storage to keep malloc out of per-template processing.
+ * Blocks are rounded up to power of two size classes and freed blocks are
+ * kept in a per-thread arena for reuse, within byte budgets per class, per
+ * thread and across all threads. Blocks an arena doesn't reuse within a
+ * second are freed. Blocks larger than the largest class bypass the pool.
+ */
+namespace MatPool
+{
+    // The allocator, NULL if br::Context::matrixPool is disabled
+    cv::MatAllocator *allocator();
+
+    // Empty matrix that takes its storage from the pool once created
+    cv::Mat mat();
+
+    // Allocation counts since startup
+    QString statistics();
+}
+
+#endif // MATPOOL_H
@@ -0,0 +1,135 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QFutureSynchronizer>
+#include <QMutex>
+#include <QScopedArrayPointer>
+#include <QtConcurrentRun>
+
+#include "openbr/openbr_plugin.h"
+#include "openbr/core/parallel.h"
+
+namespace
+{
+
+const int ChunkDivisor = 4; // Chunks are this fraction of a thread's remaining share
+
+// A thread's share of the loop
+struct Share
+{
+    QMutex lock;
+    int begin, end;
+
+    int remaining()
+    {
+        QMutexLocker locker(&lock);
+        return end - begin;
+    }
+};
+
+struct Loop
+{
+    const Parallel::Body *body;
+    int grain, threads;
+    Share *shares;
+};
+
+bool takeChunk(Share &share, int grain, int &begin, int &end)
+{
+    QMutexLocker locker(&share.lock);
+    const int remaining = share.end - share.begin;
+    if (remaining <= 0)
+        return false;
+    begin = share.begin;
+    end = begin + std::min(remaining, std::max(grain, remaining / ChunkDivisor));
+    share.begin = end;
+    return true;
+}
+
+// Moves the back half of victim's share to thief, whose share is empty
+bool steal(Share &victim, Share &thief)
+{
+    QMutexLocker victimLocker(&victim.lock);
+    const int remaining = victim.end - victim.begin;
+    if (remaining <= 0)
+        return false;
+    const int begin = victim.end - (remaining + 1) / 2;
+    const int end = victim.end;
+    victim.end = begin;
+    victimLocker.unlock();
+
+    QMutexLocker thiefLocker(&thief.lock);
+    thief.begin = begin;
+    thief.end = end;
+    return true;
+}
+
+void work(const Loop *loop, int thread)
+{
+    Share &own = loop->shares[thread];
+    forever {
+        int begin, end;
+        if (takeChunk(own, loop->grain, begin, end)) {
+            (*loop->body)(begin, end);
+            continue;
+        }
+
+        int victim = -1, most = 0;
+        for (int i=0; i<loop->threads; i++) {
+            const int remaining = (i == thread) ? 0 : loop->shares[i].remaining();
+            if (remaining > most) {
+                most = remaining;
+                victim = i;
+            }
+        }
+
+        // Every share is empty, the chunks in progress finish on their threads
+        if (victim == -1)
+            return;
+        steal(loop->shares[victim], own);
+    }
+}
+
+} // namespace
+
+void Parallel::forRange(int size, const Body &body, int grain)
+{
+    grain = std::max(grain, 1);
+    const int threads = std::min(std::max(1, br::Globals->parallelism), (size + grain - 1) / grain);
+    if (threads <= 1) {
+        if (size > 0)
+            body(0, size);
+        return;
+    }
+
+    QScopedArrayPointer<Share> shares(new Share[threads]);
+    for (int i=0; i<threads; i++) {
+        shares[i].begin = qint64(size) * i / threads;
+        shares[i].end = qint64(size) * (i+1) / threads;
+    }
+
+    Loop loop;
+    loop.body = &body;
+    loop.grain = grain;
+    loop.threads = threads;
+    loop.shares = shares.data();
+
+    QFutureSynchronizer<void> futures;
+    for (int i=1; i<threads; i++)
+        futures.addFuture(QtConcurrent::run(work, &loop, i));
+    work(&loop, 0);
+    futures.waitForFinished();
+}
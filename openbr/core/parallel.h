@@ -0,0 +1,40 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+namespace Parallel
+{
+    // Work of a parallel loop over the half-open index range [begin, end)
+    struct Body
+    {
+        virtual ~Body() {}
+        virtual void operator()(int begin, int end) const = 0;
+    };
+
+    /*!
+     * Runs body over [0, size) on up to br::Context::parallelism threads,
+     * including the calling thread. Each thread starts with an equal share
+     * of the range and takes chunks from the front of it, a quarter of what
+     * remains but at least grain indices, so chunks shrink toward the end of
+     * the loop. A thread that runs out steals the back half of the largest
+     * remaining share. Loops no larger than grain run on the calling thread.
+     */
+    void forRange(int size, const Body &body, int grain = 1);
+}
+
+#endif // PARALLEL_H
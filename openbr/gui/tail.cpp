@@ -86,8 +86,8 @@ void Tail::compare()
     scores.clear();
 
     if (targetGallery.isNull() || queryGallery.isNull()) {
-        if (!targetGallery.isNull()) targetFiles = TemplateList::fromGallery(targetGallery).files();
-        if (!queryGallery.isNull()) queryFiles = TemplateList::fromGallery(queryGallery).files();
+        if (!targetGallery.isNull()) targetFiles = TemplateList::fromGallery(targetGallery, false).files();
+        if (!queryGallery.isNull()) queryFiles = TemplateList::fromGallery(queryGallery, false).files();
         slider->setMaximum(std::max(targetFiles.size(), queryFiles.size()) - 1);
         lhs->setText("First Image");
         rhs->setText("Last Image");
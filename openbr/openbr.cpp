@@ -421,7 +421,7 @@ br_matrix_output br_compare_template_lists(br_template_list target, br_template_
 float br_get_matrix_output_at(br_matrix_output output, int row, int col)
 {
     MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
-    return matOut->data.at<float>(row, col);
+    return matOut->at(row, col);
 }
 
 br_template br_get_template(br_template_list tl, int index)
@@ -470,6 +470,21 @@ void br_close_gallery(br_gallery gallery)
     delete gal;
 }
 
+void br_pin_memory_gallery(const char *gallery)
+{
+    pinMemoryGallery(File(gallery), true);
+}
+
+void br_unpin_memory_gallery(const char *gallery)
+{
+    pinMemoryGallery(File(gallery), false);
+}
+
+void br_drop_memory_gallery(const char *gallery)
+{
+    dropMemoryGallery(File(gallery));
+}
+
 void br_deduplicate(const char *input_gallery, const char *output_gallery, const char *threshold)
 {
     br::Deduplicate(input_gallery, output_gallery, threshold);
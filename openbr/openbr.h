@@ -86,6 +86,9 @@ BR_EXPORT void br_deduplicate(const char *input_gallery, const char *output_gall
  * A similarity matrix is a type of br::Output. The current clustering algorithm is a simplified implementation of \cite zhu11.
  * \param num_simmats Size of \c simmats.
  * \param simmats Array of \ref simmat composing one large self-similarity matrix arranged in row major order.
+ *                Sparse \c .smtx simmats contribute only their stored scores, so a \c topK sparse simmat is a k-NN graph.
+ *                A single gallery is instead compared against itself with the current algorithm into such a graph, kept in a temporary file.
+ *                Only inputs that no br::Format reads, such as \c .gal files and directories, are taken to be galleries.
  * \param aggressiveness The higher the aggressiveness the larger the clusters. Suggested range is [0,10].
  * \param csv The cluster results file to generate. Results are stored one row per cluster and use gallery indices.
  */
@@ -603,6 +606,25 @@ BR_EXPORT void br_add_template_list_to_gallery(br_gallery gallery, br_template_l
   * \brief Close the br::Gallery.
   */
 BR_EXPORT void br_close_gallery(br_gallery gallery);
+/*!
+  * \brief Exempt an in-memory <tt>.mem</tt> gallery from eviction.
+  * The gallery doesn't need to be loaded yet.
+  * \param gallery String name of the gallery.
+  * \see br_unpin_memory_gallery br_drop_memory_gallery
+  */
+BR_EXPORT void br_pin_memory_gallery(const char *gallery);
+/*!
+  * \brief Allow a pinned in-memory <tt>.mem</tt> gallery to be evicted again.
+  * \param gallery String name of the gallery.
+  * \see br_pin_memory_gallery
+  */
+BR_EXPORT void br_unpin_memory_gallery(const char *gallery);
+/*!
+  * \brief Release the memory held by an in-memory <tt>.mem</tt> gallery.
+  * \param gallery String name of the gallery.
+  * \see br_pin_memory_gallery
+  */
+BR_EXPORT void br_drop_memory_gallery(const char *gallery);
 
 /*! @}*/
 
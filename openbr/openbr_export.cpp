@@ -474,10 +474,13 @@ $ br -help
  * \section simmat Similarity Matrix
  * A similarity matrix (or \em simmat) is a br::Output compliant binary score matrix specified on page 12 of <a href="MBGC_file_overview.pdf#page=12">MBGC File Overview</a> and implemented in mtxOutput.
  * Simmats are identified with a <tt>.mtx</tt> extension.
+ * As an extension, a matrix type of \c H stores scores as IEEE half floats, see mtxOutput::halfPrecision.
+ * Thresholded or top-K simmats can be stored in compressed sparse row order with a <tt>.smtx</tt> extension, implemented in smtxOutput.
  * \see br_eval
  *
  * \section mask Mask Matrix
  * A mask matrix (or \em mask) is a binary matrix specified on page 14 of <a href="MBGC_file_overview.pdf#page=14">MBGC File Overview</a> identifying the ground truth genuines and impostors of a corresponding \ref simmat.
  * Masks are identified with a <tt>.mask</tt> extension.
+ * When evaluating without a mask file, the mask is computed on the fly from the labels and partitions of the simmat's galleries instead of being stored.
  * \see br_make_mask br_combine_masks
  */
@@ -16,6 +16,7 @@
 
 #include <QCoreApplication>
 #include <QCryptographicHash>
+#include <QElapsedTimer>
 #include <QFutureSynchronizer>
 #include <QLocalSocket>
 #include <QMetaProperty>
@@ -37,7 +38,9 @@
 #include "version.h"
 #include "core/bee.h"
 #include "core/common.h"
+#include "core/matpool.h"
 #include "core/opencvutils.h"
+#include "core/parallel.h"
 #include "core/qtutils.h"
 #include "openbr/plugins/openbr_internal.h"
 
@@ -397,6 +400,11 @@ int FileList::failures() const
 }
 
 /* Template - global methods */
+cv::Mat br::pooledMat()
+{
+    return MatPool::mat();
+}
+
 QDataStream &br::operator<<(QDataStream &stream, const Template &t)
 {
     return stream << static_cast<const QList<cv::Mat>&>(t) << t.file;
@@ -408,12 +416,12 @@ QDataStream &br::operator>>(QDataStream &stream, Template &t)
 }
 
 /* TemplateList - public methods */
-TemplateList TemplateList::fromGallery(const br::File &gallery)
+TemplateList TemplateList::fromGallery(const br::File &gallery, bool readMatrices)
 {
     TemplateList templates;
     foreach (const br::File &file, gallery.split()) {
         QScopedPointer<Gallery> i(Gallery::make(file));
-        TemplateList newTemplates = i->read();
+        TemplateList newTemplates = readMatrices ? i->read() : TemplateList(i->files());
 
         // If file is a Format not a Gallery (e.g. XML Format vs. XML Gallery)
         if (newTemplates.isEmpty())
@@ -1056,11 +1064,21 @@ void br::Context::printStatus()
     const float p = progress();
     if (p < 1) {
         int s = timeRemaining();
-        fprintf(stderr,"\r%05.2f%%  ELAPSED=%s  REMAINING=%s  COUNT=%g", p*100, QtUtils::toTime(Globals->startTime.elapsed()/1000.0f).toStdString().c_str(), QtUtils::toTime(s).toStdString().c_str(), Globals->currentStep);
+        QMutexLocker locker(&statusesLock);
+        const QString status = statuses.isEmpty() ? QString() : "  " + QStringList(statuses.values()).join("  ");
+        locker.unlock();
+        fprintf(stderr,"\r%05.2f%%  ELAPSED=%s  REMAINING=%s  COUNT=%g%s", p*100, QtUtils::toTime(Globals->startTime.elapsed()/1000.0f).toStdString().c_str(), QtUtils::toTime(s).toStdString().c_str(), Globals->currentStep, qPrintable(status));
         fflush(stderr);
     }
 }
 
+void br::Context::setStatus(const QString &source, const QString &status)
+{
+    QMutexLocker locker(&statusesLock);
+    if (status.isEmpty()) statuses.remove(source);
+    else                  statuses.insert(source, status);
+}
+
 float br::Context::progress() const
 {
     if (totalSteps == 0) return -1;
@@ -1189,6 +1207,9 @@ void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool useG
 
 void br::Context::finalize()
 {
+    if (Globals->verbose)
+        qDebug("%s", qPrintable(MatPool::statistics()));
+
     // Trigger registered finalizers
     QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
@@ -1332,6 +1353,12 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+void Output::setBlockScores(int rowOffset, int columnOffset, const cv::Mat &scores)
+{
+    setScores(scores, rowOffset+offset.y(), columnOffset+offset.x());
+    if (!next.isNull()) next->setBlockScores(rowOffset, columnOffset, scores);
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1346,11 +1373,21 @@ Output *Output::make(const File &file, const FileList &targetFiles, const FileLi
     return output;
 }
 
+/* Output - private methods */
+void Output::setScores(const cv::Mat &scores, int i, int j)
+{
+    for (int r=0; r<scores.rows; r++) {
+        const float *row = scores.ptr<float>(r);
+        for (int c=0; c<scores.cols; c++)
+            set(row[c], i+r, j+c);
+    }
+}
+
 /* MatrixOutput - public methods */
 void MatrixOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
 {
     Output::initialize(targetFiles, queryFiles);
-    data.create(queryFiles.size(), targetFiles.size(), CV_32FC1);
+    data.create(queryFiles.size(), targetFiles.size(), halfPrecision ? CV_16UC1 : CV_32FC1);
 }
 
 MatrixOutput *MatrixOutput::make(const FileList &targetFiles, const FileList &queryFiles)
@@ -1358,16 +1395,33 @@ MatrixOutput *MatrixOutput::make(const FileList &targetFiles, const FileList &qu
     return dynamic_cast<MatrixOutput*>(Output::make(".Matrix", targetFiles, queryFiles));
 }
 
+float MatrixOutput::at(int row, int column) const
+{
+    if (data.type() == CV_16UC1) return BEE::fromHalf(data.at<BEE::HalfSimmatValue>(row,column));
+    else                         return data.at<float>(row,column);
+}
+
 /* MatrixOutput - protected methods */
 QString MatrixOutput::toString(int row, int column) const
 {
-    return QString::number(data.at<float>(row,column));
+    return QString::number(at(row,column));
 }
 
 /* MatrixOutput - private methods */
 void MatrixOutput::set(float value, int i, int j)
 {
-    data.at<float>(i,j) = value;
+    if (data.type() == CV_16UC1) data.at<BEE::HalfSimmatValue>(i,j) = BEE::toHalf(value);
+    else                         data.at<float>(i,j) = value;
+}
+
+void MatrixOutput::setScores(const cv::Mat &scores, int i, int j)
+{
+    if (data.type() == CV_16UC1) {
+        for (int r=0; r<scores.rows; r++)
+            BEE::toHalf(scores.ptr<float>(r), data.ptr<BEE::HalfSimmatValue>(i+r)+j, scores.cols);
+    } else {
+        scores.copyTo(data(cv::Rect(j, i, scores.cols, scores.rows)));
+    }
 }
 
 BR_REGISTER(Output, MatrixOutput)
@@ -1396,7 +1450,7 @@ FileList Gallery::files()
 {
     FileList files;
     bool done = false;
-    while (!done) files.append(readBlock(&done).files());
+    while (!done) files.append(readFiles(&done));
     return files;
 }
 
@@ -1519,18 +1573,60 @@ static void _project(const Transform *transform, const Template *src, Template *
     }
 }
 
+namespace
+{
+
+struct ProjectBody : public Parallel::Body
+{
+    const Transform *transform;
+    const TemplateList *src;
+    Template *dst;
+
+    void operator()(int begin, int end) const
+    {
+        for (int i=begin; i<end; i++)
+            _project(transform, &src->at(i), &dst[i]);
+    }
+};
+
+} // namespace
+
 // Default project(TemplateList) calls project(Template) separately for each element
 void Transform::project(const TemplateList &src, TemplateList &dst) const
 {
-    dst.reserve(src.size());
+    if (!Globals->workStealing) {
+        const int offset = dst.size();
+        for (int i=0; i<src.size(); i++)
+            dst.append(Template());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<src.size(); i++)
+            if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[offset+i]));
+            else                          _project(this, &src[i], &dst[offset+i]);
+        futures.waitForFinished();
+        return;
+    }
+
+    QVector<Template> results(src.size());
+    ProjectBody body;
+    body.transform = this;
+    body.src = &src;
+    body.dst = results.data();
+    Parallel::forRange(src.size(), body);
+
+    dst.reserve(dst.size() + src.size());
+    foreach (const Template &t, results)
+        dst.append(t);
+}
 
-    for (int i=0; i<src.size(); i++)
-        dst.append(Template());
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<dst.size(); i++)
-        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
-        else                          _project(this, &src[i], &dst[i]);
-    futures.waitForFinished();
+// Default projectBatch calls project(Template) sequentially for each element
+void Transform::projectBatch(const TemplateList &src, TemplateList &dst) const
+{
+    dst.clear();
+    dst.reserve(src.size());
+    for (int i=0; i<src.size(); i++) {
+        dst.append(Template(src[i].file));
+        _project(this, &src[i], &dst.last());
+    }
 }
 
 TemplateEvent *Transform::getEvent(const QString &name)
@@ -1584,21 +1680,74 @@ Distance *Distance::make(QString str, QObject *parent)
     return distance;
 }
 
+namespace br
+{
+
+struct CompareBody : public Parallel::Body
+{
+    const Distance *distance;
+    const TemplateList *target, *query;
+    Output *output;
+    bool stepTarget;
+    int offset; // Into the stepped side
+
+    void operator()(int begin, int end) const
+    {
+        begin += offset;
+        end += offset;
+        if (stepTarget) distance->compareBlock(TemplateList(target->mid(begin, end-begin)), *query, output, begin, 0);
+        else            distance->compareBlock(*target, TemplateList(query->mid(begin, end-begin)), output, 0, begin);
+    }
+};
+
+} // namespace br
+
 void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
 {
-    const bool stepTarget = target.size() > query.size();
-    const int totalSize = std::max(target.size(), query.size());
-    int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<totalSize; i+=stepSize) {
-        const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
-        const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
-        const int targetOffset = stepTarget ? i : 0;
-        const int queryOffset = stepTarget ? 0 : i;
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
-        else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+    // Row outputs finish a query row once every target is compared against it,
+    // so step over queries for them whenever there are enough to keep every thread busy
+    const bool rowOutput = (qobject_cast<RowOutput*>(output) != NULL) && (query.size() >= std::max(1, abs(Globals->parallelism)));
+    const bool stepTarget = (target.size() > query.size()) && !rowOutput;
+    const int totalSize = stepTarget ? target.size() : query.size();
+
+    if (!Globals->workStealing) {
+        int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<totalSize; i+=stepSize) {
+            const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
+            const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
+            const int targetOffset = stepTarget ? i : 0;
+            const int queryOffset = stepTarget ? 0 : i;
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
+            else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+        }
+        futures.waitForFinished();
+        return;
     }
-    futures.waitForFinished();
+
+    CompareBody body;
+    body.distance = this;
+    body.target = &target;
+    body.query = &query;
+    body.output = output;
+    body.stepTarget = stepTarget;
+    body.offset = 0;
+
+    // Comparison cost spans orders of magnitude between distances, so the grain is measured rather than fixed:
+    // time single indices of the stepped side on this thread until the cost is measurable,
+    // then chunk the rest into about ChunkNanoseconds of work each.
+    static const qint64 ProbeNanoseconds = 50000, ChunkNanoseconds = 1000000;
+    QElapsedTimer timer;
+    timer.start();
+    int probed = 0;
+    while ((probed < totalSize) && ((probed == 0) || (timer.nsecsElapsed() < ProbeNanoseconds))) {
+        body(probed, probed+1);
+        probed++;
+    }
+
+    const qint64 nanosecondsPerIndex = std::max(qint64(1), timer.nsecsElapsed() / std::max(1, probed));
+    body.offset = probed;
+    Parallel::forRange(totalSize - probed, body, int(std::min(qint64(totalSize), ChunkNanoseconds / nanosecondsPerIndex)));
 }
 
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
@@ -1645,10 +1794,21 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
 /* Distance - private methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
-    for (int i=0; i<query.size(); i++)
-        for (int j=0; j<target.size(); j++)
-            if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
-            else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+    if (target.isEmpty())
+        return;
+
+    // Scores are handed to the output in tiles of whole rows of roughly 64K scores
+    const int tileRows = std::max(1, 65536 / target.size());
+    for (int i=0; i<query.size(); i+=tileRows) {
+        cv::Mat scores(std::min(tileRows, query.size()-i), target.size(), CV_32FC1);
+        for (int r=0; r<scores.rows; r++) {
+            float *row = scores.ptr<float>(r);
+            for (int j=0; j<target.size(); j++)
+                if (target[j].isEmpty() || query[i+r].isEmpty()) row[j] = -std::numeric_limits<float>::max();
+                else row[j] = compare(target[j], query[i+r]);
+        }
+        output->setBlockScores(i+queryOffset, targetOffset, scores);
+    }
 }
 
 void br::applyAdditionalProperties(const File &temp, Transform *target)
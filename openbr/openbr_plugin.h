@@ -28,6 +28,7 @@
 #include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMutex>
 #include <QPoint>
 #include <QPointF>
 #include <QRectF>
@@ -374,6 +375,13 @@ struct BR_EXPORT FileList : public QList<File>
     static FileList fromGallery(const File &gallery, bool cache = false); /*!< \brief Create a file list from a br::Gallery. */
 };
 
+/*!
+ * \brief Returns an empty matrix that takes its storage from a pool of recycled buffers once created.
+ * Template::m() uses it when the template is empty, so the destination of most transforms is pooled.
+ * \see Context::matrixPool
+ */
+BR_EXPORT cv::Mat pooledMat();
+
 /*!
  * \brief A list of matrices associated with a file.
  *
@@ -398,7 +406,7 @@ struct Template : public QList<cv::Mat>
 
     inline const cv::Mat &m() const { static const cv::Mat NullMatrix;
                                       return isEmpty() ? qFatal("Empty template."), NullMatrix : last(); } /*!< \brief Idiom to treat the template as a matrix. */
-    inline cv::Mat &m() { return isEmpty() ? append(cv::Mat()), last() : last(); } /*!< \brief Idiom to treat the template as a matrix. */
+    inline cv::Mat &m() { return isEmpty() ? append(pooledMat()), last() : last(); } /*!< \brief Idiom to treat the template as a matrix. */
     inline operator const File &() const { return file; }
     inline cv::Mat &operator=(const cv::Mat &other) { return m() = other; } /*!< \brief Idiom to treat the template as a matrix. */
     inline operator const cv::Mat&() const { return m(); } /*!< \brief Idiom to treat the template as a matrix. */
@@ -450,7 +458,7 @@ struct TemplateList : public QList<Template>
     TemplateList() {}
     TemplateList(const QList<Template> &templates) { append(templates); } /*!< \brief Initialize the template list from another template list. */
     TemplateList(const QList<File> &files) { foreach (const File &file, files) append(file); } /*!< \brief Initialize the template list from a file list. */
-    BR_EXPORT static TemplateList fromGallery(const File &gallery); /*!< \brief Create a template list from a br::Gallery. */
+    BR_EXPORT static TemplateList fromGallery(const File &gallery, bool readMatrices = true); /*!< \brief Create a template list from a br::Gallery, if \em readMatrices is \c false only metadata is read. */
 
     /*!< \brief Create a template list from a memory buffer of individual templates. Compatible with '.gal' galleries. */
     BR_EXPORT static TemplateList fromBuffer(const QByteArray &buffer);
@@ -642,6 +650,8 @@ class BR_EXPORT Context : public Object
 {
     Q_OBJECT
     QFile logFile;
+    QMap<QString,QString> statuses;
+    QMutex statusesLock;
 
 public:
     /*!
@@ -754,6 +764,49 @@ public:
     Q_PROPERTY(int crossValidate READ get_crossValidate WRITE set_crossValidate RESET reset_crossValidate)
     BR_PROPERTY(int, crossValidate, 0)
 
+    /*!
+     * \brief Memory budget in megabytes for galleries held by br::memGallery, \c 0 (default) for no limit.
+     * Least recently used galleries that are not pinned are evicted once the budget is exceeded.
+     * Only galleries read from a backing \c .gal file are evicted, since they are read again on their next use.
+     */
+    Q_PROPERTY(int memGalleryBudget READ get_memGalleryBudget WRITE set_memGalleryBudget RESET reset_memGalleryBudget)
+    BR_PROPERTY(int, memGalleryBudget, 0)
+
+    /*!
+     * \brief Evaluate similarity matrices by binning scores into <tt>2^evalHistogramBits</tt> bins per thread, \c 0 (default) for an exact sort.
+     * Binning needs a single streaming pass and constant memory, \c 20 bits resolves scores to about 0.05% of their magnitude.
+     * Operating points are exact at bin edges, the reported TAR @ FAR error bound is the TAR gained across the straddling bins.
+     * CMC is computed exactly.
+     * \see br::Evaluate
+     */
+    Q_PROPERTY(int evalHistogramBits READ get_evalHistogramBits WRITE set_evalHistogramBits RESET reset_evalHistogramBits)
+    BR_PROPERTY(int, evalHistogramBits, 0)
+
+    /*!
+     * \brief Pass frames between br::StreamTransform stages through lock-free ring buffers (default), or the original locking buffers if \c false.
+     */
+    Q_PROPERTY(bool lockFreeStreams READ get_lockFreeStreams WRITE set_lockFreeStreams RESET reset_lockFreeStreams)
+    BR_PROPERTY(bool, lockFreeStreams, true)
+
+    /*!
+     * \brief Append the per-stage statistics of each br::StreamTransform run to this file as a line of JSON, \c "" (default) to not record them.
+     */
+    Q_PROPERTY(QString streamStatistics READ get_streamStatistics WRITE set_streamStatistics RESET reset_streamStatistics)
+    BR_PROPERTY(QString, streamStatistics, "")
+
+    /*!
+     * \brief Recycle the storage of matrices created through Template::m() in per-thread pools (default), or allocate each with \c malloc if \c false.
+     * Pool statistics are printed at exit when #verbose.
+     */
+    Q_PROPERTY(bool matrixPool READ get_matrixPool WRITE set_matrixPool RESET reset_matrixPool)
+    BR_PROPERTY(bool, matrixPool, true)
+
+    /*!
+     * \brief Split Transform::project() and Distance::compare() into work-stealing chunks (default), or run the original one future per template and per block if \c false.
+     */
+    Q_PROPERTY(bool workStealing READ get_workStealing WRITE set_workStealing RESET reset_workStealing)
+    BR_PROPERTY(bool, workStealing, true)
+
     QHash<QString,QString> abbreviations; /*!< \brief Used by br::Transform::make() to expand abbreviated algorithms into their complete definitions. */
     QTime startTime; /*!< \brief Used to estimate timeRemaining(). */
 
@@ -777,6 +830,11 @@ public:
      */
     void printStatus();
 
+    /*!
+     * \brief Sets a short status from \em source that printStatus() appends to its line, an empty \em status removes it.
+     */
+    void setStatus(const QString &source, const QString &status);
+
     /*!
      * \brief Returns the completion percentage of a call to br::Train(), br::Enroll() or br::Compare().
      * \return float Fraction completed.
@@ -1040,6 +1098,7 @@ public:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
     virtual void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
     virtual void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    virtual void setBlockScores(int rowOffset, int columnOffset, const cv::Mat &scores); /*!< \brief Set a \c CV_32FC1 tile of scores whose top left corner is relative to the current block. */
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
 
@@ -1047,17 +1106,23 @@ private:
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual void setScores(const cv::Mat &scores, int i, int j); /*!< \brief Set a tile of scores at an absolute position, defaults to set() for each score. */
 };
 
 /*!
  * \ingroup outputs
  * \brief Plugin derived base class for storing outputs as matrices.
+ *
+ * With \em halfPrecision the scores are stored as IEEE half floats in a \c CV_16UC1 matrix, see BEE::toHalf().
  */
 class BR_EXPORT MatrixOutput : public Output
 {
     Q_OBJECT
 
 public:
+    Q_PROPERTY(bool halfPrecision READ get_halfPrecision WRITE set_halfPrecision RESET reset_halfPrecision STORED false)
+    BR_PROPERTY(bool, halfPrecision, false)
+
     cv::Mat data; /*!< \brief The similarity matrix. */
 
     /*!
@@ -1065,12 +1130,15 @@ public:
      */
     static MatrixOutput *make(const FileList &targetFiles, const FileList &queryFiles);
 
+    float at(int row, int column) const; /*!< \brief The requested similarity score, regardless of storage precision. */
+
 protected:
     QString toString(int row, int column) const; /*!< \brief Converts the value requested similarity score to a string. */
 
 private:
     void initialize(const FileList &targetFiles, const FileList &queryFiles);
     void set(float value, int i, int j);
+    void setScores(const cv::Mat &scores, int i, int j);
 };
 
 /*!
@@ -1121,6 +1189,7 @@ public:
     TemplateList read(); /*!< \brief Retrieve all the stored templates. */
     FileList files(); /*!< \brief Retrieve all the stored template files. */
     virtual TemplateList readBlock(bool *done) = 0; /*!< \brief Retrieve a portion of the stored templates. */
+    virtual FileList readFiles(bool *done) { return readBlock(done).files(); } /*!< \brief Retrieve a portion of the stored template files, formats that can should skip over matrix data. */
     void writeBlock(const TemplateList &templates); /*!< \brief Serialize a template list. */
     virtual void write(const Template &t) = 0; /*!< \brief Serialize a template. */
     static Gallery *make(const File &file); /*!< \brief Make a gallery to/from a file on disk. */
@@ -1207,6 +1276,18 @@ public:
      */
     virtual void project(const TemplateList &src, TemplateList &dst) const;
 
+    /*!< \brief Apply the transform to each template in src independently, dst[i] is the result for src[i].
+     * Transforms that are faster over many stacked templates at once (e.g. as a single matrix product) should implement
+     * projectBatch and report true to batchable. By default each template is projected separately with project(Template).
+     */
+    virtual void projectBatch(const TemplateList &src, TemplateList &dst) const;
+
+    /*!
+     * \brief Does projectBatch give the same result as project(Template) on each template?
+     * Only then may callers such as Stream stack templates from separate calls into one batch.
+     */
+    virtual bool batchable() const { return false; }
+
     /*!< \brief Apply the transform to a single template, may update the transform's internal state
      * By default, just call project, we can always call a const function from a non-const function.
      * If a transform implements projectUpdate, it should report true to timeVarying so that it can be
@@ -1382,6 +1463,7 @@ private:
     virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
 
     friend struct AlgorithmCore;
+    friend struct CompareBody;
     virtual bool compare(const File &targetGallery, const File &queryGallery, const File &output) const /*!< \brief Escape hatch for algorithms that need customized file I/O during comparison. */
         { (void) targetGallery; (void) queryGallery; (void) output; return false; }
 };
@@ -43,6 +43,26 @@ class EigenInitializer : public Initializer
 
 BR_REGISTER(Initializer, EigenInitializer)
 
+// Stacks a batch of templates as the columns of a matrix
+static Eigen::MatrixXf stackColumns(const TemplateList &src, int dims)
+{
+    Eigen::MatrixXf stacked(dims, src.size());
+    for (int i=0; i<src.size(); i++)
+        stacked.col(i) = Eigen::Map<const Eigen::VectorXf>(src[i].m().ptr<float>(), dims);
+    return stacked;
+}
+
+// Splits the columns of a matrix into single row templates with the files of src
+static void unstackColumns(const Eigen::MatrixXf &stacked, const TemplateList &src, TemplateList &dst)
+{
+    dst.clear();
+    dst.reserve(src.size());
+    for (int i=0; i<src.size(); i++) {
+        dst.append(Template(src[i].file, cv::Mat(1, stacked.rows(), CV_32FC1)));
+        Eigen::Map<Eigen::VectorXf>(dst.last().m().ptr<float>(), stacked.rows()) = stacked.col(i);
+    }
+}
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
@@ -119,6 +139,19 @@ private:
         outMap = eVecs.transpose() * (inMap - mean);
     }
 
+    // One matrix product over the stacked templates
+    void projectBatch(const TemplateList &src, TemplateList &dst) const
+    {
+        Eigen::MatrixXf out((int)keep, src.size());
+        out.noalias() = eVecs.transpose() * (stackColumns(src, mean.rows()).colwise() - mean);
+        unstackColumns(out, src, dst);
+    }
+
+    bool batchable() const
+    {
+        return true;
+    }
+
     void store(QDataStream &stream) const
     {
         stream << keep << drop << whiten << originalRows << mean << eVals << eVecs;
@@ -262,6 +295,32 @@ class RowWisePCATransform : public PCATransform
             outMap = eVecs.transpose() * (inMap - mean);
         }
     }
+
+    // One matrix product over the rows of all the templates
+    void projectBatch(const TemplateList &src, TemplateList &dst) const
+    {
+        int rows = 0;
+        foreach (const Template &t, src)
+            rows += t.m().rows;
+
+        Eigen::MatrixXf in(mean.rows(), rows);
+        int index = 0;
+        foreach (const Template &t, src)
+            for (int i=0; i<t.m().rows; i++)
+                in.col(index++) = Eigen::Map<const Eigen::VectorXf>(t.m().ptr<float>(i), mean.rows());
+
+        Eigen::MatrixXf out((int)keep, rows);
+        out.noalias() = eVecs.transpose() * (in.colwise() - mean);
+
+        dst.clear();
+        dst.reserve(src.size());
+        index = 0;
+        foreach (const Template &t, src) {
+            dst.append(Template(t.file, cv::Mat(t.m().rows, keep, CV_32FC1)));
+            for (int i=0; i<t.m().rows; i++)
+                Eigen::Map<Eigen::VectorXf>(dst.last().m().ptr<float>(i), out.rows()) = out.col(index++);
+        }
+    }
 };
 
 BR_REGISTER(Transform, RowWisePCATransform)
@@ -527,6 +586,21 @@ class LDATransform : public Transform
             dst.m().at<float>(0,0) = dst.m().at<float>(0,0) / stdDev;
     }
 
+    // One matrix product over the stacked templates
+    void projectBatch(const TemplateList &src, TemplateList &dst) const
+    {
+        Eigen::MatrixXf out(dimsOut, src.size());
+        out.noalias() = projection.transpose() * (stackColumns(src, mean.rows()).colwise() - mean);
+        if (normalize && isBinary)
+            out.row(0) /= stdDev;
+        unstackColumns(out, src, dst);
+    }
+
+    bool batchable() const
+    {
+        return true;
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
@@ -0,0 +1,215 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QFile>
+#include <QtConcurrentRun>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+typedef QPair<int,int> ClusterPair;
+
+// Pairs of clusters with representatives at least threshold similar
+static QList<ClusterPair> findMerges(const Distance *distance, const TemplateList &gallery, const QList<int> &clusters, float threshold)
+{
+    QList<ClusterPair> merges;
+    for (int i=0; i<gallery.size(); i++) {
+        const QList<float> scores = distance->compare(gallery, gallery[i]);
+        for (int j=i+1; j<gallery.size(); j++)
+            if ((clusters[i] != clusters[j]) && (scores[j] >= threshold))
+                merges.append(ClusterPair(clusters[i], clusters[j]));
+    }
+    return merges;
+}
+
+/*!
+ * \ingroup transforms
+ * \brief Incrementally clusters templates as they stream in, setting \em outputVariable to the cluster id.
+ *
+ * Each template is compared against the representatives of the existing clusters with \em distance.
+ * It joins the cluster of the most similar representative if the score is at least \em threshold, otherwise it starts a new cluster.
+ * The first \em representatives members of a cluster are its representatives.
+ *
+ * Every \em mergeInterval templates the representatives are compared against each other in the background, and clusters with representatives at least \em threshold similar are merged.
+ * Merged clusters take the smaller id, templates that have already been projected keep the id they were given.
+ *
+ * If \em checkpoint is set the clustering state is loaded from it on initialization, and saved to it every \em checkpointInterval templates and on finalization.
+ */
+class OnlineClusterTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(int representatives READ get_representatives WRITE set_representatives RESET reset_representatives STORED false)
+    Q_PROPERTY(int mergeInterval READ get_mergeInterval WRITE set_mergeInterval RESET reset_mergeInterval STORED false)
+    Q_PROPERTY(QString checkpoint READ get_checkpoint WRITE set_checkpoint RESET reset_checkpoint STORED false)
+    Q_PROPERTY(int checkpointInterval READ get_checkpointInterval WRITE set_checkpointInterval RESET reset_checkpointInterval STORED false)
+    Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(float, threshold, 0)
+    BR_PROPERTY(int, representatives, 1)
+    BR_PROPERTY(int, mergeInterval, 0)
+    BR_PROPERTY(QString, checkpoint, "")
+    BR_PROPERTY(int, checkpointInterval, 0)
+    BR_PROPERTY(QString, outputVariable, "ClusterID")
+
+    TemplateList gallery; // Cluster representatives
+    QList<int> galleryClusters; // Cluster of each representative when it was added
+    QVector<int> parents; // Merged clusters point towards the cluster they merged into
+    QVector<int> representativeCounts;
+    qint64 processed;
+
+    QFuture< QList<ClusterPair> > merging;
+    bool mergePending;
+
+    int root(int cluster)
+    {
+        while (parents[cluster] != cluster)
+            cluster = parents[cluster] = parents[parents[cluster]];
+        return cluster;
+    }
+
+    void applyMerges()
+    {
+        if (!mergePending)
+            return;
+        foreach (const ClusterPair &pair, merging.result()) {
+            const int a = root(pair.first), b = root(pair.second);
+            if (a == b) continue;
+            parents[std::max(a, b)] = std::min(a, b);
+            representativeCounts[std::min(a, b)] += representativeCounts[std::max(a, b)];
+        }
+        mergePending = false;
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        dst = src;
+        if (src.file.fte)
+            return;
+        if (distance == NULL)
+            qFatal("Null distance.");
+
+        if (mergePending && merging.isFinished())
+            applyMerges();
+
+        // Join the cluster of the most similar representative or start a new one
+        int cluster = -1;
+        if (!gallery.isEmpty()) {
+            const QList<float> scores = distance->compare(gallery, src);
+            int best = 0;
+            for (int i=1; i<scores.size(); i++)
+                if (scores[i] > scores[best])
+                    best = i;
+            if (scores[best] >= threshold)
+                cluster = root(galleryClusters[best]);
+        }
+
+        if (cluster == -1) {
+            cluster = parents.size();
+            parents.append(cluster);
+            representativeCounts.append(0);
+        }
+
+        if (representativeCounts[cluster] < representatives) {
+            gallery.append(src);
+            galleryClusters.append(cluster);
+            representativeCounts[cluster]++;
+        }
+
+        dst.file.set(outputVariable, cluster);
+        processed++;
+
+        if ((mergeInterval > 0) && (processed % mergeInterval == 0) && !mergePending) {
+            merging = QtConcurrent::run(findMerges, (const Distance*) distance, gallery, galleryClusters, threshold);
+            mergePending = true;
+        }
+
+        if ((checkpointInterval > 0) && (processed % checkpointInterval == 0))
+            save();
+    }
+
+    void finalize(TemplateList &output)
+    {
+        (void) output;
+        if (mergePending) {
+            merging.waitForFinished();
+            applyMerges();
+        }
+        save();
+
+        int clusters = 0;
+        for (int i=0; i<parents.size(); i++)
+            if (parents[i] == i)
+                clusters++;
+        qDebug("%lld templates in %d clusters", processed, clusters);
+    }
+
+    void save() const
+    {
+        if (checkpoint.isEmpty())
+            return;
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        store(stream);
+        QtUtils::writeFile(checkpoint, data);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << gallery << galleryClusters << parents << representativeCounts << processed;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> gallery >> galleryClusters >> parents >> representativeCounts >> processed;
+    }
+
+    void init()
+    {
+        gallery.clear();
+        galleryClusters.clear();
+        parents.clear();
+        representativeCounts.clear();
+        processed = 0;
+        mergePending = false;
+
+        if (!checkpoint.isEmpty() && QFile::exists(checkpoint)) {
+            QByteArray data;
+            QtUtils::readFile(checkpoint, data);
+            QDataStream stream(&data, QFile::ReadOnly);
+            load(stream);
+        }
+    }
+
+public:
+    OnlineClusterTransform() : TimeVaryingTransform(false, false) {}
+
+    ~OnlineClusterTransform()
+    {
+        merging.waitForFinished();
+    }
+};
+
+BR_REGISTER(Transform, OnlineClusterTransform)
+
+} // namespace br
+
+#include "cluster/onlinecluster.moc"
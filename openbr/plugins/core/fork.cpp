@@ -14,18 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/parallel.h>
 
 namespace br
 {
 
-static void _train(Transform *transform, const QList<TemplateList> *data)
-{
-    transform->train(*data);
-}
-
 /*!
  * \ingroup transforms
  * \brief Transforms in parallel.
@@ -39,13 +33,25 @@ class ForkTransform : public CompositeTransform
 {
     Q_OBJECT
 
+    struct TrainBody : public Parallel::Body
+    {
+        const QList<Transform*> *transforms;
+        const QList<TemplateList> *data;
+
+        void operator()(int begin, int end) const
+        {
+            for (int i=begin; i<end; i++)
+                (*transforms)[i]->train(*data);
+        }
+    };
+
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
-        QFutureSynchronizer<void> futures;
-        for (int i=0; i<transforms.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
-        futures.waitForFinished();
+        TrainBody body;
+        body.transforms = &transforms;
+        body.data = &data;
+        Parallel::forRange(transforms.size(), body);
     }
 
     // same as _project, but calls projectUpdate on sub-transforms
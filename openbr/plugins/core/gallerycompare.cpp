@@ -46,6 +46,11 @@ class GalleryCompareTransform : public Transform
         dst.m() = OpenCVUtils::toMat(line, 1);
     }
 
+    bool batchable() const
+    {
+        return true;
+    }
+
     void init()
     {
         if (!galleryName.isEmpty())
@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/parallel.h>
 
 using namespace cv;
 
@@ -126,10 +125,17 @@ class IndependentTransform : public MetaTransform
 
     bool timeVarying() const { return transform->timeVarying(); }
 
-    static void _train(Transform *transform, const TemplateList *data)
+    struct TrainBody : public Parallel::Body
     {
-        transform->train(*data);
-    }
+        const QList<Transform*> *transforms;
+        const QList<TemplateList> *templatesList;
+
+        void operator()(int begin, int end) const
+        {
+            for (int i=begin; i<end; i++)
+                (*transforms)[i]->train((*templatesList)[i]);
+        }
+    };
 
     void train(const TemplateList &data)
     {
@@ -149,10 +155,10 @@ class IndependentTransform : public MetaTransform
         while (transforms.size() < templatesList.size())
             transforms.append(transform->clone());
 
-        QFutureSynchronizer<void> futures;
-        for (int i=0; i<templatesList.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i]));
-        futures.waitForFinished();
+        TrainBody body;
+        body.transforms = &transforms;
+        body.templatesList = &templatesList;
+        Parallel::forRange(templatesList.size(), body);
     }
 
     void project(const Template &src, Template &dst) const
@@ -140,6 +140,39 @@ class PipeTransform : public CompositeTransform
         dst.append(ftes);
     }
 
+    bool batchable() const
+    {
+        if (timeVarying())
+            return false;
+        foreach (const Transform *f, transforms)
+            if (!f->batchable())
+                return false;
+        return true;
+    }
+
+    // Each transform projects the whole batch at once, failures to enroll
+    // keep their place and skip the remaining transforms.
+    void projectBatch(const TemplateList &src, TemplateList &dst) const
+    {
+        dst = src;
+        foreach (const Transform *f, transforms) {
+            QList<int> indices;
+            TemplateList batch;
+            for (int i=0; i<dst.size(); i++)
+                if (!dst[i].file.fte) {
+                    indices.append(i);
+                    batch.append(dst[i]);
+                }
+            if (batch.isEmpty())
+                break;
+
+            TemplateList res;
+            f->projectBatch(batch, res);
+            for (int i=0; i<indices.size(); i++)
+                dst[indices[i]] = res[i];
+        }
+    }
+
     virtual void finalize(TemplateList &output)
     {
         output.clear();
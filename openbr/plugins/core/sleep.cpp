@@ -0,0 +1,66 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QElapsedTimer>
+#include <QThread>
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Delays each template by a fixed time, for profiling stream scheduling with synthetic stages.
+ *
+ * \em busy spins the CPU instead of sleeping, \em serial makes the transform time varying so that streams run it in a single-threaded stage.
+ */
+class SleepTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int msecs READ get_msecs WRITE set_msecs RESET reset_msecs STORED false)
+    Q_PROPERTY(bool busy READ get_busy WRITE set_busy RESET reset_busy STORED false)
+    Q_PROPERTY(bool serial READ get_serial WRITE set_serial RESET reset_serial STORED false)
+    BR_PROPERTY(int, msecs, 10)
+    BR_PROPERTY(bool, busy, false)
+    BR_PROPERTY(bool, serial, false)
+
+    bool timeVarying() const
+    {
+        return serial;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        if (!busy) {
+            QThread::msleep(msecs);
+            return;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        volatile double x = 1;
+        while (timer.elapsed() < msecs)
+            for (int i=0; i<1000; i++)
+                x = x * 1.0000001 + 1e-9;
+    }
+};
+
+BR_REGISTER(Transform, SleepTransform)
+
+} // namespace br
+
+#include "core/sleep.moc"
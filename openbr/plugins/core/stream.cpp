@@ -15,10 +15,15 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QReadWriteLock>
 #include <QWaitCondition>
 #include <QThreadPool>
 #include <QSemaphore>
+#include <QThread>
 #include <QMap>
 #include <QQueue>
 #include <QtConcurrent>
@@ -40,7 +45,39 @@ class FrameData
 {
 public:
     int sequenceNumber;
+    qint64 queuedAt; // When the frame was added to a stage's input buffer, by that stage's clock
     TemplateList data;
+    QList<FrameData *> batched; // Frames projected together with this one
+};
+
+// Counters of a processing stage, updated by all the threads running it
+struct StageStatistics
+{
+    static const int DepthBins = 16; // Bin i > 0 counts depths in [2^(i-1), 2^i), the last bin is open ended
+
+    QAtomicInt items;
+    QAtomicInteger<qint64> busy; // Nanoseconds spent in the transform
+    QAtomicInteger<qint64> waitInput; // Nanoseconds a single thread stage was stopped for lack of input
+    QAtomicInteger<qint64> queued; // Nanoseconds frames waited in the input buffer
+    QAtomicInt depths[DepthBins]; // Input buffer depth seen by each queued frame
+
+    void reset()
+    {
+        items.store(0);
+        busy.store(0);
+        waitInput.store(0);
+        queued.store(0);
+        for (int i=0; i < DepthBins; i++)
+            depths[i].store(0);
+    }
+
+    void addDepth(int depth)
+    {
+        int bin = 0;
+        while ((bin < DepthBins - 1) && ((depth >> bin) > 0))
+            bin++;
+        depths[bin].ref();
+    }
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -55,6 +92,158 @@ public:
 
     virtual FrameData *tryGetItem()=0;
     virtual int size()=0;
+
+    // Buffers for 1 - 1 boundaries and the frame pool (sequenced = false), or n - 1 boundaries
+    static SharedBuffer *make(bool sequenced, int capacity);
+};
+
+// Lock-free alternative to SequencingBuffer. Frames are contiguously numbered
+// and at most capacity of them are in flight, so a frame can only be up to
+// capacity - 1 ahead of the next frame to return. Each sequence number maps to
+// its own slot of a ring, producers publish to their slot and the consumer
+// claims the next target by advancing it.
+class ReorderBuffer : public SharedBuffer
+{
+public:
+    ReorderBuffer(int capacity) : capacity(capacity), slots(new QAtomicPointer<FrameData>[capacity])
+    {
+        for (int i=0; i < capacity; i++)
+            slots[i].store(NULL);
+    }
+
+    ~ReorderBuffer()
+    {
+        delete[] slots;
+    }
+
+    void addItem(FrameData *input)
+    {
+        if (!slots[input->sequenceNumber % capacity].testAndSetRelease(NULL, input))
+            qFatal("Frame %d is outside of the reorder window.", input->sequenceNumber);
+        count.ref();
+    }
+
+    FrameData *tryGetItem()
+    {
+        const int target = next_target.load();
+        QAtomicPointer<FrameData> &slot = slots[target % capacity];
+        FrameData *output = slot.loadAcquire();
+        if (output == NULL)
+            return NULL;
+
+        // Another consumer claimed it first
+        if (!next_target.testAndSetOrdered(target, target + 1))
+            return NULL;
+
+        if (output->sequenceNumber != target)
+            qFatal("mismatched targets!");
+        slot.storeRelease(NULL);
+        count.deref();
+        return output;
+    }
+
+    int size()
+    {
+        return count.load();
+    }
+
+    void reset()
+    {
+        if (size() != 0)
+            qDebug("Reorder buffer has non-zero size during reset!");
+        next_target.store(0);
+    }
+
+private:
+    const int capacity;
+    QAtomicPointer<FrameData> *slots;
+    QAtomicInt next_target;
+    QAtomicInt count;
+};
+
+// Lock-free alternative to DoubleBuffer, a bounded FIFO ring (D. Vyukov's
+// bounded MPMC queue). Each cell carries a sequence number telling producers
+// when it is free and consumers when it is full, so adding and removing only
+// contend on their own position counter.
+class RingBuffer : public SharedBuffer
+{
+public:
+    RingBuffer(int capacity)
+    {
+        int size = 1;
+        while (size < capacity)
+            size *= 2;
+        mask = size - 1;
+        cells = new Cell[size];
+        for (int i=0; i < size; i++)
+            cells[i].sequence.store(i);
+    }
+
+    ~RingBuffer()
+    {
+        delete[] cells;
+    }
+
+    void addItem(FrameData *input)
+    {
+        int position = tail.load();
+        forever {
+            Cell &cell = cells[position & mask];
+            const int difference = int(unsigned(cell.sequence.loadAcquire()) - unsigned(position));
+            if (difference == 0) {
+                if (tail.testAndSetRelaxed(position, position + 1)) {
+                    cell.data = input;
+                    cell.sequence.storeRelease(position + 1);
+                    return;
+                }
+            } else if (difference < 0) {
+                qFatal("Ring buffer overflow.");
+            }
+            position = tail.load();
+        }
+    }
+
+    FrameData *tryGetItem()
+    {
+        int position = head.load();
+        forever {
+            Cell &cell = cells[position & mask];
+            const int difference = int(unsigned(cell.sequence.loadAcquire()) - unsigned(position + 1));
+            if (difference == 0) {
+                if (head.testAndSetRelaxed(position, position + 1)) {
+                    FrameData *output = cell.data;
+                    cell.sequence.storeRelease(position + mask + 1);
+                    return output;
+                }
+            } else if (difference < 0) {
+                return NULL;
+            }
+            position = head.load();
+        }
+    }
+
+    int size()
+    {
+        return tail.load() - head.load();
+    }
+
+    void reset()
+    {
+        if (size() != 0)
+            qDebug("Ring buffer has non-zero size during reset!");
+    }
+
+private:
+    struct Cell
+    {
+        QAtomicInt sequence;
+        FrameData *data;
+    };
+
+    Cell *cells;
+    int mask;
+    QAtomicInt head;
+    QAtomicInt tail;
 };
 
 // for n - 1 boundaries, multiple threads call addItem, the frames are
@@ -200,6 +389,13 @@ private:
     QList<FrameData *> buffer2;
 };
 
+SharedBuffer *SharedBuffer::make(bool sequenced, int capacity)
+{
+    if (Globals->lockFreeStreams)
+        return sequenced ? (SharedBuffer *) new ReorderBuffer(capacity) : (SharedBuffer *) new RingBuffer(capacity);
+    return sequenced ? (SharedBuffer *) new SequencingBuffer() : (SharedBuffer *) new DoubleBuffer();
+}
+
 // Given a template as input, open the file contained as a gallery, and return templates one at a time on
 // calls to getNextTemplate
 struct StreamGallery
@@ -267,13 +463,13 @@ protected:
 class DataSource
 {
 public:
-    DataSource(int maxFrames=500)
+    DataSource(int maxFrames=500) : allFrames(SharedBuffer::make(false, maxFrames))
     {
         // The sequence number of the last frame
         final_frame = -1;
         for (int i=0; i < maxFrames;i++)
         {
-            allFrames.addItem(new FrameData());
+            allFrames->addItem(new FrameData());
         }
     }
 
@@ -281,7 +477,7 @@ public:
     {
         while (true)
         {
-            FrameData *frame = allFrames.tryGetItem();
+            FrameData *frame = allFrames->tryGetItem();
             if (frame == NULL)
                 break;
             delete frame;
@@ -298,6 +494,16 @@ public:
         return this->templates.size();
     }
 
+    // Frames read since open()
+    int framesRead() const
+    {
+        return next_sequence_number;
+    }
+
+    // Times a frame was requested while all activeFrames were in flight. No
+    // frames are dropped, reading resumes when a frame is returned.
+    QAtomicInt poolExhausted;
+
     bool open(const TemplateList &input)
     {
         // Set up variables specific to us
@@ -306,6 +512,7 @@ public:
 
         is_broken = false;
         allReturned = false;
+        poolExhausted.store(0);
 
         // The last frame isn't initialized yet
         final_frame = -1;
@@ -338,9 +545,11 @@ public:
 
         // Try to get a FrameData from the pool, if we can't it means too many
         // frames are already out, and we will return NULL to indicate failure
-        FrameData *aFrame = allFrames.tryGetItem();
-        if (aFrame == NULL)
+        FrameData *aFrame = allFrames->tryGetItem();
+        if (aFrame == NULL) {
+            poolExhausted.ref();
             return NULL;
+        }
 
         // Try to actually read a frame, if this returns false the data source is broken
         bool res = getNextFrame(*aFrame);
@@ -368,9 +577,10 @@ public:
     {
         int frameNumber = inputFrame->sequenceNumber;
 
+        // Pooled matrix storage of the frame goes back to this thread's arena
         inputFrame->data.clear();
         inputFrame->sequenceNumber = -1;
-        allFrames.addItem(inputFrame);
+        allFrames->addItem(inputFrame);
 
         bool rval = false;
 
@@ -478,7 +688,7 @@ protected:
     bool is_broken;
     bool allReturned;
 
-    DoubleBuffer allFrames;
+    QScopedPointer<SharedBuffer> allFrames;
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
@@ -509,6 +719,10 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        transform = NULL;
+        inputBuffer = NULL;
+        statistics.reset();
+        clock.start();
     }
     virtual ~ProcessingStage() {}
 
@@ -522,6 +736,81 @@ public:
 
     virtual void status()=0;
 
+    virtual QString type() const=0;
+
+    // Frames waiting to enter this stage
+    virtual int backlog() const
+    {
+        return inputBuffer ? inputBuffer->size() : 0;
+    }
+
+    // Most threads the stage can use at once
+    virtual int capacity() const
+    {
+        return thread_count;
+    }
+
+    // Limits the number of threads projecting in this stage, stages that
+    // cannot be limited ignore it.
+    virtual void allot(int threads)
+    {
+        (void) threads;
+    }
+
+    void startThread(br::FrameData *newItem)
+    {
+        BasicLoop *next = new BasicLoop();
+        next->stages = stages;
+        next->start_idx = this->stage_id;
+        next->startItem = newItem;
+
+        // We start threads with priority equal to their stage id
+        // This is intended to ensure progression, we do queued late stage
+        // jobs before queued early stage jobs, and so tend to finish frames
+        // rather than go stage by stage. In Qt 5.1, priorities are priorities
+        // so we use the stage_id directly. The scheduler may additionally
+        // boost the bottleneck stage ahead of the others.
+        this->threads->start(next, stage_id + priorityBoost.load());
+    }
+
+    QAtomicInt priorityBoost;
+
+    // Clears the statistics and restarts the clock they are measured by
+    virtual void resetStatistics()
+    {
+        statistics.reset();
+        clock.start();
+    }
+
+    QJsonObject statisticsJson() const
+    {
+        QJsonObject json;
+        json.insert("stage", stage_id);
+        json.insert("type", type());
+        if (transform)
+            json.insert("transform", transform->description());
+        json.insert("threads", thread_count);
+        json.insert("items", statistics.items.load());
+        json.insert("busySeconds", statistics.busy.load() / 1e9);
+        json.insert("waitInputSeconds", statistics.waitInput.load() / 1e9);
+        json.insert("queuedSeconds", statistics.queued.load() / 1e9);
+        QJsonArray depths;
+        for (int i=0; i < StageStatistics::DepthBins; i++)
+            depths.append(statistics.depths[i].load());
+        json.insert("queueDepthHistogram", depths);
+        return json;
+    }
+
+    // Fraction of its threads' time spent in the transform
+    float utilization() const
+    {
+        const qint64 elapsed = clock.nsecsElapsed();
+        return elapsed == 0 ? 0 : float(statistics.busy.load()) / (elapsed * qint64(thread_count));
+    }
+
+    StageStatistics statistics;
+    QElapsedTimer clock;
+
 protected:
     int thread_count;
 
@@ -536,7 +825,35 @@ protected:
 class MultiThreadStage : public ProcessingStage
 {
 public:
-    MultiThreadStage(int _input) : ProcessingStage(_input) {}
+    // A limited stage lets at most allotted threads project at once and
+    // queues the other frames, maxThreads caps the allotment (0 for no cap).
+    // With batchSize > 1 a thread projects up to batchSize queued frames at
+    // once, queued frames wait at most batchLatency nanoseconds for a batch
+    // to fill while other threads are projecting, after which a flusher
+    // thread starts the batch.
+    MultiThreadStage(int _input, int _maxThreads = 0, bool _limited = false, int _batchSize = 1, qint64 _batchLatency = 0)
+        : ProcessingStage(_input), maxThreads(_maxThreads), batchSize(std::max(_batchSize, 1)), batchLatency(_batchLatency),
+          limited(_limited || (_maxThreads > 0) || (_batchSize > 1)), active(0), deadline(-1), stopping(false), flusher(NULL)
+    {
+        allotted = capacity();
+        if ((batchSize > 1) && (batchLatency > 0)) {
+            flusher = new Flusher(this);
+            flusher->start();
+        }
+    }
+
+    ~MultiThreadStage()
+    {
+        if (!flusher)
+            return;
+        {
+            QMutexLocker lock(&queueLock);
+            stopping = true;
+            deadlineChanged.wakeAll();
+        }
+        flusher->wait();
+        delete flusher;
+    }
 
     // Not much to worry about here, we will project the input
     // and try to continue to the next stage.
@@ -546,53 +863,251 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
+        if (!input->batched.isEmpty())
+            return runBatch(input, should_continue, final);
+
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
+        const qint64 start = clock.nsecsElapsed();
         transform->project(input->data, res);
+        statistics.busy.fetchAndAddRelaxed(clock.nsecsElapsed() - start);
+        statistics.items.ref();
         input->data = res;
         input->data.append(ftes);
 
+        // Hand our place in the stage to a queued frame
+        if (limited)
+            dispatch(true);
+
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
         return input;
     }
 
-    // Called from a different thread than run. Nothing to worry about
-    // we offer no restrictions on when loops may enter this stage.
+    // Called from a different thread than run. Unless limited, we offer
+    // no restrictions on when loops may enter this stage.
     virtual bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
-        (void) input;
         final = false;
-        return true;
+        if (!limited)
+            return true;
+
+        // The frame is started by dispatch if it can't start now
+        QMutexLocker lock(&queueLock);
+        input->queuedAt = clock.nsecsElapsed();
+        waiting.enqueue(input);
+        input = takeBatch();
+        if (!waiting.isEmpty())
+            statistics.addDepth(waiting.size());
+        return input != NULL;
+    }
+
+    int backlog() const
+    {
+        QMutexLocker lock(&queueLock);
+        return waiting.size();
+    }
+
+    int capacity() const
+    {
+        return maxThreads > 0 ? std::min(maxThreads, thread_count) : thread_count;
+    }
+
+    void allot(int threads)
+    {
+        if (!limited)
+            return;
+        QMutexLocker lock(&queueLock);
+        allotted = std::max(1, std::min(threads, capacity()));
+        lock.unlock();
+        dispatch(false);
     }
 
     void reset()
     {
-        // nothing to do.
+        QMutexLocker lock(&queueLock);
+        if (!waiting.isEmpty())
+            qFatal("multi thread stage %d reset with queued frames", this->stage_id);
+        active = 0;
+        deadline = -1;
+        allotted = capacity();
     }
+
     void status() {
-        qDebug("multi thread stage %d, nothing to worry about", this->stage_id);
+        QMutexLocker lock(&queueLock);
+        qDebug("multi thread stage %d, active %d of %d, queued %d", this->stage_id, active, allotted, waiting.size());
+    }
+
+    QString type() const { return "multiThread"; }
+
+private:
+    int maxThreads;
+    int batchSize;
+    qint64 batchLatency;
+    bool limited;
+    mutable QMutex queueLock;
+    int active, allotted; // Threads projecting in the stage and how many may
+    QQueue<FrameData *> waiting;
+
+    // Starts batches held back for batchLatency once it expires, since no
+    // other thread may come back for the queue in time.
+    class Flusher : public QThread
+    {
+        MultiThreadStage *stage;
+    public:
+        Flusher(MultiThreadStage *_stage) : stage(_stage) {}
+        void run() { stage->flush(); }
+    };
+
+    QWaitCondition deadlineChanged;
+    qint64 deadline; // When the oldest held back frame must start, -1 if none is
+    bool stopping;
+    Flusher *flusher;
+
+    void flush()
+    {
+        QMutexLocker lock(&queueLock);
+        while (!stopping) {
+            if (deadline < 0) {
+                deadlineChanged.wait(&queueLock);
+                continue;
+            }
+
+            const qint64 remaining = deadline - clock.nsecsElapsed();
+            if (remaining > 0) {
+                deadlineChanged.wait(&queueLock, remaining / 1000000 + 1);
+                continue;
+            }
+
+            // takeBatch sets a new deadline if it holds back again
+            deadline = -1;
+            QList<FrameData *> started;
+            while (FrameData *batch = takeBatch())
+                started.append(batch);
+            lock.unlock();
+            foreach (FrameData *batch, started)
+                startThread(batch);
+            lock.relock();
+        }
+    }
+
+    // Projects input and the frames batched with it. Frames holding a single
+    // template are stacked into one projectBatch call, others are projected
+    // on their own.
+    FrameData *runBatch(FrameData *input, bool &should_continue, bool &final)
+    {
+        QList<FrameData *> frames;
+        frames.append(input);
+        frames.append(input->batched);
+        input->batched.clear();
+
+        const qint64 start = clock.nsecsElapsed();
+        QList<TemplateList> ftes;
+        QList<int> stackedFrames;
+        TemplateList stacked;
+        for (int i=0; i<frames.size(); i++) {
+            ftes.append(TemplateList());
+            splitFTEs(frames[i]->data, ftes.last());
+            if (frames[i]->data.size() == 1) {
+                stackedFrames.append(i);
+                stacked.append(frames[i]->data.first());
+            } else {
+                TemplateList res;
+                transform->project(frames[i]->data, res);
+                frames[i]->data = res;
+            }
+        }
+
+        TemplateList res;
+        if (!stacked.isEmpty())
+            transform->projectBatch(stacked, res);
+        if (res.size() != stacked.size())
+            qFatal("%s projected %d templates into %d", qPrintable(transform->description()), stacked.size(), res.size());
+        for (int i=0; i<stackedFrames.size(); i++) {
+            frames[stackedFrames[i]]->data.clear();
+            frames[stackedFrames[i]]->data.append(res[i]);
+        }
+        statistics.busy.fetchAndAddRelaxed(clock.nsecsElapsed() - start);
+        statistics.items.fetchAndAddRelaxed(frames.size());
+
+        for (int i=0; i<frames.size(); i++)
+            frames[i]->data.append(ftes[i]);
+
+        dispatch(true);
+
+        // We carry the last frame on, the others continue on threads of their own
+        for (int i=0; i<frames.size()-1; i++) {
+            FrameData *frame = frames[i];
+            bool unused;
+            if (nextStage->tryAcquireNextStage(frame, unused))
+                nextStage->startThread(frame);
+        }
+
+        FrameData *last = frames.last();
+        should_continue = nextStage->tryAcquireNextStage(last, final);
+        return last;
+    }
+
+    // Takes the next batch to project from the queue if a thread may start
+    // on it, NULL otherwise. Call with queueLock held.
+    FrameData *takeBatch()
+    {
+        if (waiting.isEmpty() || (active >= allotted))
+            return NULL;
+
+        // While other threads are projecting, and so will come back for the
+        // queue, give the batch some time to fill.
+        const qint64 now = clock.nsecsElapsed();
+        if ((active > 0) && (waiting.size() < batchSize) && (now - waiting.head()->queuedAt < batchLatency)) {
+            if (deadline < 0) {
+                deadline = waiting.head()->queuedAt + batchLatency;
+                deadlineChanged.wakeAll();
+            }
+            return NULL;
+        }
+
+        active++;
+        FrameData *batch = waiting.dequeue();
+        statistics.queued.fetchAndAddRelaxed(now - batch->queuedAt);
+        while ((batch->batched.size() + 1 < batchSize) && !waiting.isEmpty()) {
+            FrameData *frame = waiting.dequeue();
+            statistics.queued.fetchAndAddRelaxed(now - frame->queuedAt);
+            batch->batched.append(frame);
+        }
+        return batch;
+    }
+
+    // Starts queued batches while the allotment allows, release gives up
+    // the place of the calling thread first.
+    void dispatch(bool release)
+    {
+        QList<FrameData *> started;
+        QMutexLocker lock(&queueLock);
+        if (release)
+            active--;
+        while (FrameData *batch = takeBatch())
+            started.append(batch);
+        lock.unlock();
+
+        foreach (FrameData *batch, started)
+            startThread(batch);
     }
 };
 
 class SingleThreadStage : public ProcessingStage
 {
 public:
-    SingleThreadStage(bool input_variance) : ProcessingStage(1)
+    SingleThreadStage(bool input_variance, int activeFrames) : ProcessingStage(1)
     {
         currentStatus = STOPPING;
         next_target = 0;
         // If the previous stage is single-threaded, queued inputs
-        // are stored in a double buffer
-        if (input_variance) {
-            this->inputBuffer = new DoubleBuffer();
-        }
-        // If it's multi-threaded we need to put the inputs back in order
-        // before we can use them, so we use a sequencing buffer.
-        else {
-            this->inputBuffer = new SequencingBuffer();
-        }
+        // are stored in a double buffer. If it's multi-threaded we need
+        // to put the inputs back in order before we can use them, so we
+        // use a sequencing buffer. At most activeFrames are in flight.
+        this->inputBuffer = SharedBuffer::make(!input_variance, activeFrames);
+        stoppedAt = 0;
     }
 
     ~SingleThreadStage()
@@ -604,10 +1119,17 @@ public:
     {
         QWriteLocker writeLock(&statusLock);
         currentStatus = STOPPING;
+        stoppedAt = clock.nsecsElapsed();
         next_target = 0;
         inputBuffer->reset();
     }
 
+    void resetStatistics()
+    {
+        QWriteLocker writeLock(&statusLock);
+        ProcessingStage::resetStatistics();
+        stoppedAt = 0;
+    }
 
     int next_target;
     enum Status
@@ -617,6 +1139,26 @@ public:
     };
     QReadWriteLock statusLock;
     Status currentStatus;
+    qint64 stoppedAt; // When currentStatus last became STOPPING
+
+    // Call with statusLock held for writing
+    void setStatus(Status status)
+    {
+        const qint64 now = clock.nsecsElapsed();
+        if ((status == STARTING) && (currentStatus == STOPPING))
+            statistics.waitInput.fetchAndAddRelaxed(now - stoppedAt);
+        else if ((status == STOPPING) && (currentStatus == STARTING))
+            stoppedAt = now;
+        currentStatus = status;
+    }
+
+    FrameData *takeInput()
+    {
+        FrameData *item = inputBuffer->tryGetItem();
+        if (item)
+            statistics.queued.fetchAndAddRelaxed(clock.nsecsElapsed() - item->queuedAt);
+        return item;
+    }
 
     FrameData *run(FrameData *input, bool &should_continue, bool &final)
     {
@@ -631,7 +1173,10 @@ public:
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
+        const qint64 start = clock.nsecsElapsed();
         transform->projectUpdate(input->data, res);
+        statistics.busy.fetchAndAddRelaxed(clock.nsecsElapsed() - start);
+        statistics.items.ref();
         input->data = res;
         input->data.append(ftes);
 
@@ -642,10 +1187,10 @@ public:
 
         // Is there anything on our input buffer? If so we should start a thread with that.
         QWriteLocker lock(&statusLock);
-        FrameData *newItem = inputBuffer->tryGetItem();
+        FrameData *newItem = takeInput();
         if (!newItem)
         {
-            this->currentStatus = STOPPING;
+            setStatus(STOPPING);
         }
         lock.unlock();
 
@@ -655,27 +1200,14 @@ public:
         return input;
     }
 
-    void startThread(br::FrameData *newItem)
-    {
-        BasicLoop *next = new BasicLoop();
-        next->stages = stages;
-        next->start_idx = this->stage_id;
-        next->startItem = newItem;
-
-        // We start threads with priority equal to their stage id
-        // This is intended to ensure progression, we do queued late stage
-        // jobs before queued early stage jobs, and so tend to finish frames
-        // rather than go stage by stage. In Qt 5.1, priorities are priorities
-        // so we use the stage_id directly.
-        this->threads->start(next, stage_id);
-    }
-
 
     // Calledfrom a different thread than run.
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
         final = false;
+        input->queuedAt = clock.nsecsElapsed();
         inputBuffer->addItem(input);
+        statistics.addDepth(inputBuffer->size());
 
         QReadLocker lock(&statusLock);
         // Thread is already running, we should just return
@@ -694,12 +1226,12 @@ public:
         }
         // Ok we might start a thread, as long as we can get something back
         // from the input buffer
-        input = inputBuffer->tryGetItem();
+        input = takeInput();
 
         if (!input)
             return false;
 
-        currentStatus = STARTING;
+        setStatus(STARTING);
 
         return true;
     }
@@ -708,15 +1240,114 @@ public:
         qDebug("single thread stage %d, status starting? %d, next %d buffer size %d", this->stage_id, this->currentStatus == SingleThreadStage::STARTING, this->next_target, this->inputBuffer->size());
     }
 
+    QString type() const { return "singleThread"; }
+
+};
+
+// Periodically shifts the thread allotment of limited multi-threaded stages
+// toward the bottleneck. By Little's law a stage needs its per-frame service
+// time times the stream throughput threads to keep up. The stage with the
+// highest demand relative to its capacity, weighted by its backlog, is the
+// bottleneck; it gets its full capacity and a priority boost so its queued
+// work is picked up first, the others get their demand plus some headroom.
+class StageScheduler
+{
+public:
+    static const qint64 Interval = 100000000; // Nanoseconds between updates
+
+    StageScheduler() : last(0) {}
+
+    void reset(int stages)
+    {
+        items.fill(0, stages);
+        busy.fill(0, stages);
+        service.fill(0, stages);
+        last = 0;
+    }
+
+    // Called by the end stage, now is measured by its clock
+    void update(const QList<ProcessingStage *> &stages, qint64 now)
+    {
+        if ((now - last < Interval) || (stages.size() != items.size()))
+            return;
+
+        // Wait for frames to leave the stream before measuring throughput
+        const qint64 completed = stages.last()->statistics.items.load() - items.last();
+        if (completed == 0)
+            return;
+        const double throughput = completed / ((now - last) / 1e9);
+        last = now;
+
+        int bottleneck = 0;
+        float maxPressure = -1;
+        QVector<float> demand(stages.size());
+        for (int i=0; i<stages.size(); i++) {
+            const qint64 currentItems = stages[i]->statistics.items.load();
+            const qint64 currentBusy = stages[i]->statistics.busy.load();
+            if (currentItems > items[i])
+                service[i] = (currentBusy - busy[i]) / 1e9 / (currentItems - items[i]);
+            items[i] = currentItems;
+            busy[i] = currentBusy;
+
+            demand[i] = service[i] * throughput;
+            const float pressure = demand[i] * (1 + stages[i]->backlog()) / stages[i]->capacity();
+            if (pressure > maxPressure) {
+                maxPressure = pressure;
+                bottleneck = i;
+            }
+        }
+
+        for (int i=0; i<stages.size(); i++) {
+            stages[i]->priorityBoost.store(i == bottleneck ? stages.size() : 0);
+            stages[i]->allot(i == bottleneck ? stages[i]->capacity() : int(ceil(Headroom * demand[i])) + 1);
+        }
+    }
+
+private:
+    static const float Headroom;
+    QVector<qint64> items, busy; // Statistics at the last update
+    QVector<float> service; // Seconds per frame
+    qint64 last;
 };
 
+const float StageScheduler::Headroom = 1.5f;
+
 class EndStage : public SingleThreadStage
 {
 public:
-    EndStage(bool input_variance) : SingleThreadStage(input_variance) {}
+    EndStage(bool input_variance, int activeFrames) : SingleThreadStage(input_variance, activeFrames), scheduler(NULL), lastStatus(0) {}
 
     ~EndStage() {}
 
+    FrameData *run(FrameData *input, bool &should_continue, bool &final)
+    {
+        // Report the utilization of each stage to Context::printStatus() about once a second
+        const qint64 now = clock.nsecsElapsed();
+        if (now - lastStatus > 1000000000) {
+            QStringList utilizations;
+            foreach (const ProcessingStage *stage, *stages)
+                utilizations.append(QString::number(int(100 * stage->utilization())) + "%");
+            Globals->setStatus(statusSource(), "STAGES=" + utilizations.join("/"));
+            lastStatus = now;
+        }
+
+        if (scheduler)
+            scheduler->update(*stages, now);
+
+        return SingleThreadStage::run(input, should_continue, final);
+    }
+
+    QString statusSource() const
+    {
+        return "Stream" + QString::number(quintptr(this));
+    }
+
+    void resetStatistics()
+    {
+        SingleThreadStage::resetStatistics();
+        lastStatus = 0;
+    }
+
     // Calledfrom a different thread than run.
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
@@ -736,6 +1367,13 @@ public:
         qDebug("end stage %d, status starting? %d, next %d buffer size %d", this->stage_id, this->currentStatus == SingleThreadStage::STARTING, this->next_target, this->inputBuffer->size());
     }
 
+    QString type() const { return "end"; }
+
+    StageScheduler *scheduler; // NULL unless threads are allotted adaptively
+
+private:
+    qint64 lastStatus;
+
 };
 
 // Semi-functional, doesn't do anything productive outside of stream::train
@@ -790,7 +1428,7 @@ BR_REGISTER(Transform, CollectOutputTransform)
 class ReadStage : public SingleThreadStage
 {
 public:
-    ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
+    ReadStage(int activeFrames = 100) : SingleThreadStage(true, activeFrames), dataSource(activeFrames){ }
 
     DataSource dataSource;
 
@@ -813,13 +1451,13 @@ public:
         // frame if a frame is currently available.
         QWriteLocker lock(&statusLock);
         bool last_frame = false;
-        FrameData *newFrame = dataSource.tryGetFrame(last_frame);
+        FrameData *newFrame = getFrame(last_frame);
 
         // Were we able to get a frame?
         if (newFrame) startThread(newFrame);
         // If not this stage will enter a stopped state.
         else {
-            currentStatus = STOPPING;
+            setStatus(STOPPING);
         }
 
         lock.unlock();
@@ -862,20 +1500,34 @@ public:
         bool last_frame = false;
         // Try to get a frame from the data source, if we get one we will
         // continue to the first stage.
-        input = dataSource.tryGetFrame(last_frame);
+        input = getFrame(last_frame);
 
         if (!input) {
             return false;
         }
 
-        currentStatus = STARTING;
+        setStatus(STARTING);
 
         return true;
     }
 
+    // Reading is the work of this stage
+    FrameData *getFrame(bool &last_frame)
+    {
+        const qint64 start = clock.nsecsElapsed();
+        FrameData *frame = dataSource.tryGetFrame(last_frame);
+        if (frame) {
+            statistics.busy.fetchAndAddRelaxed(clock.nsecsElapsed() - start);
+            statistics.items.ref();
+        }
+        return frame;
+    }
+
     void status() {
         qDebug("Read stage %d, status starting? %d, next frame %d buffer size %d", this->stage_id, this->currentStatus == SingleThreadStage::STARTING, this->next_target, this->dataSource.size());
     }
+
+    QString type() const { return "read"; }
 };
 
 void BasicLoop::run()
@@ -908,11 +1560,21 @@ class DirectStreamTransform : public CompositeTransform
 public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
+    Q_PROPERTY(bool adaptiveThreads READ get_adaptiveThreads WRITE set_adaptiveThreads RESET reset_adaptiveThreads)
+    Q_PROPERTY(QList<int> threadCaps READ get_threadCaps WRITE set_threadCaps RESET reset_threadCaps)
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize)
+    Q_PROPERTY(int batchLatency READ get_batchLatency WRITE set_batchLatency RESET reset_batchLatency)
+    BR_PROPERTY(bool, adaptiveThreads, false)
+    BR_PROPERTY(QList<int>, threadCaps, QList<int>())
+    BR_PROPERTY(int, batchSize, 1)
+    BR_PROPERTY(int, batchLatency, 2)
 
     friend class StreamTransfrom;
 
+    DirectStreamTransform() : readStage(NULL), collectionStage(NULL) {}
+
     void subProject(QList<TemplateList> &data, int end_idx)
     {
         if (end_idx == 0)
@@ -1018,9 +1680,16 @@ public:
             return;
         }
 
+        foreach (ProcessingStage *stage, processingStages) {
+            stage->resetStatistics();
+            stage->priorityBoost.store(0);
+        }
+        scheduler.reset(processingStages.size());
+        elapsed.start();
+
         // Start the first thread in the stream.
         QWriteLocker lock(&readStage->statusLock);
-        readStage->currentStatus = SingleThreadStage::STARTING;
+        readStage->setStatus(SingleThreadStage::STARTING);
 
         // We have to get a frame before starting the thread
         bool last_frame = false;
@@ -1065,10 +1734,42 @@ public:
         endPoint->finalize(output);
         dst.append(output);
 
+        Globals->setStatus(collectionStage->statusSource(), "");
+        if (!Globals->streamStatistics.isEmpty()) {
+            QFile file(Globals->streamStatistics);
+            QtUtils::touchDir(file);
+            if (!file.open(QFile::Append))
+                qFatal("Unable to open %s for appending.", qPrintable(Globals->streamStatistics));
+            file.write(QJsonDocument(statistics()).toJson(QJsonDocument::Compact) + "\n");
+        }
+
         foreach (ProcessingStage *stage, processingStages)
             stage->reset();
     }
 
+    // Per-stage statistics of the most recent run, waitOutputSeconds of a
+    // stage is the time its output waited in the input buffer of the next.
+    Q_INVOKABLE QJsonObject statistics() const
+    {
+        QJsonArray stages;
+        for (int i=0; i < processingStages.size(); i++) {
+            QJsonObject stage = processingStages[i]->statisticsJson();
+            const bool hasNext = (i+1 < processingStages.size()) && (processingStages[i+1] != readStage);
+            stage.insert("waitOutputSeconds", hasNext ? processingStages[i+1]->statistics.queued.load() / 1e9 : 0.0);
+            stages.append(stage);
+        }
+
+        QJsonObject json;
+        json.insert("seconds", elapsed.isValid() ? elapsed.nsecsElapsed() / 1e9 : 0.0);
+        json.insert("frames", readStage ? readStage->dataSource.framesRead() : 0);
+        json.insert("activeFrames", activeFrames);
+        json.insert("adaptiveThreads", adaptiveThreads);
+        json.insert("batchSize", batchSize);
+        json.insert("poolExhausted", readStage ? readStage->dataSource.poolExhausted.load() : 0);
+        json.insert("stages", stages);
+        return json;
+    }
+
 
     // Create and link stages
     void init()
@@ -1122,9 +1823,10 @@ public:
             if (stage_variance[i])
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
+                processingStages.append(new SingleThreadStage(prev_stage_variance, activeFrames));
             else
-                processingStages.append(new MultiThreadStage(Globals->parallelism));
+                processingStages.append(new MultiThreadStage(Globals->parallelism, threadCaps.value(i, 0), adaptiveThreads,
+                                                             transforms[i]->batchable() ? batchSize : 1, batchLatency * qint64(1000000)));
 
             processingStages.last()->stage_id = next_stage_id++;
 
@@ -1141,8 +1843,9 @@ public:
 
         // We also have the last stage, which just puts the output of the
         // previous stages on a template list.
-        collectionStage = new EndStage(prev_stage_variance);
+        collectionStage = new EndStage(prev_stage_variance, activeFrames);
         collectionStage->transform = this->endPoint;
+        collectionStage->scheduler = adaptiveThreads ? &scheduler : NULL;
 
 
         processingStages.append(collectionStage);
@@ -1172,7 +1875,9 @@ protected:
     QList<bool> stage_variance;
 
     ReadStage *readStage;
-    SingleThreadStage *collectionStage;
+    EndStage *collectionStage;
+    StageScheduler scheduler;
+    QElapsedTimer elapsed;
 
     QList<ProcessingStage *> processingStages;
 
@@ -1223,9 +1928,21 @@ public:
 
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(bool adaptiveThreads READ get_adaptiveThreads WRITE set_adaptiveThreads RESET reset_adaptiveThreads)
+    Q_PROPERTY(QList<int> threadCaps READ get_threadCaps WRITE set_threadCaps RESET reset_threadCaps)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize)
+    Q_PROPERTY(int batchLatency READ get_batchLatency WRITE set_batchLatency RESET reset_batchLatency)
 
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    // Shift threads toward the slowest stage while running
+    BR_PROPERTY(bool, adaptiveThreads, false)
+    // Most threads each stage may use after grouping, 0 for no cap
+    BR_PROPERTY(QList<int>, threadCaps, QList<int>())
+    // Most frames projected at once by stages whose transforms are batchable
+    BR_PROPERTY(int, batchSize, 1)
+    // Milliseconds queued frames may wait for a batch to fill
+    BR_PROPERTY(int, batchLatency, 2)
 
     bool timeVarying() const { return true; }
 
@@ -1248,6 +1965,11 @@ public:
         basis->train(data);
     }
 
+    Q_INVOKABLE QJsonObject statistics() const
+    {
+        return basis ? basis->statistics() : QJsonObject();
+    }
+
     virtual void finalize(TemplateList &output)
     {
         (void) output;
@@ -1266,6 +1988,10 @@ public:
         basis = QSharedPointer<DirectStreamTransform>((DirectStreamTransform *) Transform::make("DirectStream",this));
         basis->transforms.clear();
         basis->activeFrames = this->activeFrames;
+        basis->adaptiveThreads = this->adaptiveThreads;
+        basis->threadCaps = this->threadCaps;
+        basis->batchSize = this->batchSize;
+        basis->batchLatency = this->batchLatency;
         basis->endPoint = this->endPoint;
 
         // We need at least a CompositeTransform * to acess transform's children.
@@ -1339,6 +2065,10 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->adaptiveThreads = this->adaptiveThreads;
+        res->threadCaps = this->threadCaps;
+        res->batchSize = this->batchSize;
+        res->batchLatency = this->batchLatency;
         return res;
     }
 
@@ -58,6 +58,23 @@ class maskFormat : public mtxFormat
 
 BR_REGISTER(Format, maskFormat)
 
+/*!
+ * \ingroup formats
+ * \brief Reads a sparse similarity matrix written by br::smtxOutput.
+ */
+class smtxFormat : public mtxFormat
+{
+    Q_OBJECT
+
+    void write(const Template &t) const
+    {
+        (void) t;
+        qFatal("Write sparse similarity matrices with smtxOutput.");
+    }
+};
+
+BR_REGISTER(Format, smtxFormat)
+
 } // namespace br
 
 #include "format/mtx.moc"
@@ -101,7 +101,8 @@ class BinaryGallery : public Gallery
         }
     }
 
-    TemplateList readBlock(bool *done)
+    // Reads up to readBlockSize records with read, starting over at the end of the gallery
+    TemplateList readRecords(bool *done, Template (BinaryGallery::*read)())
     {
         readOpen();
         if (gallery.atEnd())
@@ -109,7 +110,7 @@ class BinaryGallery : public Gallery
 
         TemplateList templates;
         while ((templates.size() < readBlockSize) && !gallery.atEnd()) {
-            const Template t = readTemplate();
+            const Template t = (this->*read)();
             if (!t.isEmpty() || !t.file.isNull()) {
                 templates.append(t);
                 templates.last().file.set("progress", position());
@@ -124,6 +125,16 @@ class BinaryGallery : public Gallery
         return templates;
     }
 
+    TemplateList readBlock(bool *done)
+    {
+        return readRecords(done, &BinaryGallery::readTemplate);
+    }
+
+    FileList readFiles(bool *done)
+    {
+        return readRecords(done, &BinaryGallery::readMetadata).files();
+    }
+
     void write(const Template &t)
     {
         writeOpen();
@@ -147,8 +158,27 @@ protected:
         return gallery.pos();
     }
 
+    // Advance past data we don't need, seeking instead of reading when possible
+    void skip(qint64 bytes)
+    {
+        if (!gallery.isSequential()) {
+            gallery.seek(gallery.pos() + bytes);
+            return;
+        }
+
+        char buffer[4096];
+        while (bytes > 0) {
+            const qint64 bytesRead = gallery.read(buffer, std::min(bytes, qint64(sizeof(buffer))));
+            if (bytesRead <= 0) qFatal("Unexpected EOF while skipping %d bytes.", int(bytes));
+            bytes -= bytesRead;
+        }
+    }
+
     virtual Template readTemplate() = 0;
     virtual void writeTemplate(const Template &t) = 0;
+
+    // Like readTemplate(), but matrix data may be skipped, leaving empty placeholder matrices
+    virtual Template readMetadata() { return readTemplate(); }
 };
 
 /*!
@@ -170,6 +200,22 @@ class galGallery : public BinaryGallery
         return t;
     }
 
+    Template readMetadata()
+    {
+        // Mirrors operator>>(QDataStream&, Template&), seeking past each matrix's payload using its length prefix
+        Template t;
+        quint32 matrices;
+        stream >> matrices;
+        for (quint32 i=0; i<matrices; i++) {
+            int rows, cols, type, len;
+            stream >> rows >> cols >> type >> len;
+            if (len > 0) skip(len);
+            t.append(cv::Mat());
+        }
+        stream >> t.file;
+        return t;
+    }
+
     void writeTemplate(const Template &t)
     {
         if (t.isEmpty() && t.file.isNull())
@@ -193,22 +239,38 @@ class utGallery : public BinaryGallery
     Q_OBJECT
 
     Template readTemplate()
+    {
+        return readUniversalTemplate(true);
+    }
+
+    Template readMetadata()
+    {
+        return readUniversalTemplate(false);
+    }
+
+    // When readMatrices is false the feature vector is skipped (apart from the eye locations stored in it)
+    // and an empty placeholder matrix is appended instead
+    Template readUniversalTemplate(bool readMatrices)
     {
         Template t;
         br_universal_template ut;
         if (gallery.read((char*)&ut, sizeof(br_universal_template)) == sizeof(br_universal_template)) {
-            QByteArray data(ut.urlSize + ut.fvSize, Qt::Uninitialized);
+            const bool hasEyes = (ut.algorithmID <= -1) && (ut.algorithmID >= -3);
+            const qint64 fvNeeded = readMatrices ? qint64(ut.fvSize) : (hasEyes ? qint64(4*sizeof(uint32_t)) : 0);
+            QByteArray data(ut.urlSize + fvNeeded, Qt::Uninitialized);
             char *dst = data.data();
-            qint64 bytesNeeded = ut.urlSize + ut.fvSize;
+            qint64 bytesNeeded = ut.urlSize + fvNeeded;
             while (bytesNeeded > 0) {
                 qint64 bytesRead = gallery.read(dst, bytesNeeded);
                 if (bytesRead <= 0) {
                     qDebug() << gallery.errorString();
-                    qFatal("Unexepected EOF while reading universal template data, needed: %d more of: %d bytes.", int(bytesNeeded), int(ut.urlSize + ut.fvSize));
+                    qFatal("Unexepected EOF while reading universal template data, needed: %d more of: %d bytes.", int(bytesNeeded), int(ut.urlSize + fvNeeded));
                 }
                 bytesNeeded -= bytesRead;
                 dst += bytesRead;
             }
+            if (!readMatrices)
+                skip(ut.fvSize - fvNeeded);
 
             t.file.set("ImageID", QVariant(QByteArray((const char*)ut.imageID, 16).toHex()));
             t.file.set("AlgorithmID", ut.algorithmID);
@@ -229,6 +291,15 @@ class utGallery : public BinaryGallery
                 t.file.set("First_Eye", QPointF(*rightEyeX, *rightEyeY));
                 t.file.set("Second_Eye", QPointF(*leftEyeX, *leftEyeY));
             }
+            else if ((ut.algorithmID == 7) && !readMatrices) {
+                t.file.set("Label", ut.label);
+                t.file.set("X", ut.x);
+                t.file.set("Y", ut.y);
+                t.file.set("Width", ut.width);
+                t.file.set("Height", ut.height);
+                t.append(cv::Mat());
+                return t;
+            }
             else if (ut.algorithmID == 7) {
                 // binary data consisting of a single channel matrix, of a supported type.
                 // 4 element header:
@@ -269,7 +340,8 @@ class utGallery : public BinaryGallery
                 t.file.set("Height", ut.height);
             }
             t.file.set("Label", ut.label);
-            t.append(cv::Mat(1, dataSize, CV_8UC1, dataStart).clone() /* We don't want a shallow copy! */);
+            if (readMatrices) t.append(cv::Mat(1, dataSize, CV_8UC1, dataStart).clone() /* We don't want a shallow copy! */);
+            else              t.append(cv::Mat());
         } else {
             if (!gallery.atEnd())
                 qFatal("Failed to read universal template header!");
@@ -14,9 +14,16 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QDateTime>
+#include <QDirIterator>
+#include <QMutex>
+#include <QRunnable>
 #include <QStandardPaths>
+#include <QThreadPool>
+#include <QWaitCondition>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
@@ -24,6 +31,20 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Crawl a root location for image files.
+ *
+ * Directories are walked by a pool of \em threads workers which push matching files into a queue of at most \em queueSize entries,
+ * so that readBlock() can hand files to a stream as soon as they are found while memory use stays bounded.
+ * Files are filtered by \em extensions during the walk.
+ *
+ * If \em manifest is set, a record of every crawled file and directory (path, size, modification time) is written to it.
+ * On the next crawl, directories whose modification time is unchanged are expanded from the manifest instead of being listed again,
+ * and with \em incremental set only new or modified files are returned.
+ * The manifest records the \em depth and \em extensions it was crawled with, directory listings are only reused while they are unchanged.
+ *
+ * Every read() pass crawls the roots again, incremental passes compare against the manifest as it was before the first pass.
+ *
+ * Files are returned in the order the walkers find them. Directory entries aren't sorted, and with more than one thread the order varies between runs,
+ * so sort the gallery if a stable order is needed.
  * \author Josh Klontz \cite jklontz
  */
 class crawlGallery : public Gallery
@@ -35,68 +56,176 @@ class crawlGallery : public Gallery
     Q_PROPERTY(int images READ get_images WRITE set_images RESET reset_images STORED false)
     Q_PROPERTY(bool json READ get_json WRITE set_json RESET reset_json STORED false)
     Q_PROPERTY(int timeLimit READ get_timeLimit WRITE set_timeLimit RESET reset_timeLimit STORED false)
+    Q_PROPERTY(int threads READ get_threads WRITE set_threads RESET reset_threads STORED false)
+    Q_PROPERTY(int queueSize READ get_queueSize WRITE set_queueSize RESET reset_queueSize STORED false)
+    Q_PROPERTY(QStringList extensions READ get_extensions WRITE set_extensions RESET reset_extensions STORED false)
+    Q_PROPERTY(QString manifest READ get_manifest WRITE set_manifest RESET reset_manifest STORED false)
+    Q_PROPERTY(bool incremental READ get_incremental WRITE set_incremental RESET reset_incremental STORED false)
     BR_PROPERTY(bool, autoRoot, false)
     BR_PROPERTY(int, depth, INT_MAX)
     BR_PROPERTY(bool, depthFirst, false)
     BR_PROPERTY(int, images, INT_MAX)
     BR_PROPERTY(bool, json, false)
     BR_PROPERTY(int, timeLimit, INT_MAX)
+    BR_PROPERTY(int, threads, Globals->parallelism)
+    BR_PROPERTY(int, queueSize, 10000)
+    BR_PROPERTY(QStringList, extensions, QStringList() << "bmp" << "jpg" << "jpeg" << "png" << "tiff")
+    BR_PROPERTY(QString, manifest, "")
+    BR_PROPERTY(bool, incremental, false)
+
+    struct Entry
+    {
+        qint64 size; // -1 for directories
+        qint64 modified;
+        Entry() : size(-1), modified(-1) {}
+        Entry(qint64 size_, qint64 modified_) : size(size_), modified(modified_) {}
+    };
+
+    class Walker : public QRunnable
+    {
+        crawlGallery *gallery;
+    public:
+        Walker(crawlGallery *gallery_) : gallery(gallery_) {}
+        void run() { gallery->walk(); }
+    };
 
     QTime elapsed;
-    TemplateList templates;
+    QThreadPool walkers;
+    QSet<QString> suffixes;
+    QStringList roots;
+    bool passDone; // The last readBlock() finished a pass
+
+    // Guarded by lock
+    QMutex lock;
+    QWaitCondition filesAvailable, spaceAvailable, directoriesAvailable;
+    QList< QPair<QString,int> > pendingDirectories; // (path, depth)
+    QList<File> found;
+    int activeWalkers;
+    qint64 emitted;
+    bool completing, finished, stopped;
+
+    // Previous manifest, read only once the walk starts
+    QHash<QString, Entry> previous;
+    QHash<QString, QStringList> previousChildren; // Empty unless the manifest was crawled with the current settings
 
-    void crawl(QFileInfo url, int currentDepth = 0)
+    // Manifest being written, guarded by manifestLock
+    QMutex manifestLock;
+    QFile manifestFile;
+
+    ~crawlGallery()
     {
-        if ((templates.size() >= images) || (currentDepth >= depth) || (elapsed.elapsed()/1000 >= timeLimit))
-            return;
+        stop();
+    }
 
-        if (url.filePath().startsWith("file://"))
-            url = QFileInfo(url.filePath().mid(7));
-
-        if (url.isDir()) {
-            const QDir dir(url.absoluteFilePath());
-            const QFileInfoList files = dir.entryInfoList(QDir::Files);
-            const QFileInfoList subdirs = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
-            foreach (const QFileInfo &first, depthFirst ? subdirs : files)
-                crawl(first, currentDepth + 1);
-            foreach (const QFileInfo &second, depthFirst ? files : subdirs)
-                crawl(second, currentDepth + 1);
-        } else if (url.isFile()) {
-            const QString suffix = url.suffix();
-            if ((suffix == "bmp") || (suffix == "jpg") || (suffix == "jpeg") || (suffix == "png") || (suffix == "tiff")) {
-                File f;
-                if (json) f.set("URL", "file://"+url.canonicalFilePath());
-                else      f.name = "file://"+url.canonicalFilePath();
-                templates.append(f);
-            }
+    void stop()
+    {
+        {
+            QMutexLocker locker(&lock);
+            stopped = true;
+            directoriesAvailable.wakeAll();
+            spaceAvailable.wakeAll();
         }
+        walkers.waitForDone();
     }
 
     void init()
     {
-        elapsed.start();
+        passDone = false;
+        suffixes.clear();
+        foreach (const QString &extension, extensions)
+            suffixes.insert(extension.toLower());
+
+        if (!manifest.isEmpty())
+            readManifest();
+
+        roots.clear();
         const QString root = file.name.mid(0, file.name.size()-6); // Remove .crawl suffix";
         if (!root.isEmpty()) {
-            crawl(root);
+            roots.append(root);
         } else {
             if (autoRoot) {
-                foreach (const QString &path, QStandardPaths::standardLocations(QStandardPaths::HomeLocation))
-                    crawl(path);
+                roots.append(QStandardPaths::standardLocations(QStandardPaths::HomeLocation));
             } else {
                 QFile file;
                 file.open(stdin, QFile::ReadOnly);
                 while (!file.atEnd()) {
                     const QString url = QString::fromLocal8Bit(file.readLine()).simplified();
                     if (!url.isEmpty())
-                        crawl(url);
+                        roots.append(url);
                 }
             }
         }
+
+        startWalk();
+    }
+
+    // Settings that determine which entries a manifest lists
+    QString manifestSettings() const
+    {
+        QStringList sorted = suffixes.toList();
+        sorted.sort();
+        return "#settings\t" + QString::number(depth) + "\t" + sorted.join(",");
+    }
+
+    // Starts a crawl of the roots, the previous one must have finished
+    void startWalk()
+    {
+        walkers.waitForDone();
+        elapsed.start();
+        activeWalkers = 0;
+        emitted = 0;
+        completing = finished = stopped = false;
+        pendingDirectories.clear();
+        found.clear();
+
+        if (!manifest.isEmpty()) {
+            manifestFile.setFileName(manifest + ".tmp");
+            QtUtils::touchDir(manifestFile);
+            if (!manifestFile.open(QFile::WriteOnly))
+                qFatal("Failed to open %s for writing.", qPrintable(manifestFile.fileName()));
+            manifestFile.write((manifestSettings() + "\n").toUtf8());
+        }
+
+        foreach (QString url, roots) {
+            if (url.startsWith("file://"))
+                url = url.mid(7);
+            const QFileInfo info(url);
+            if (info.isDir())
+                pendingDirectories.append(qMakePair(info.canonicalFilePath(), 1));
+            else if (info.isFile() && suffixes.contains(info.suffix().toLower()))
+                offer(info.canonicalFilePath(), info.size(), info.lastModified().toMSecsSinceEpoch());
+        }
+
+        if (pendingDirectories.isEmpty()) {
+            completing = true;
+            complete();
+            return;
+        }
+
+        walkers.setMaxThreadCount(std::max(1, threads));
+        for (int i=0; i<walkers.maxThreadCount(); i++)
+            walkers.start(new Walker(this));
     }
 
     TemplateList readBlock(bool *done)
     {
-        *done = true;
+        // A new pass after a finished one crawls again
+        if (passDone) {
+            passDone = false;
+            startWalk();
+        }
+
+        TemplateList templates;
+        QMutexLocker locker(&lock);
+        while (found.isEmpty() && !finished)
+            filesAvailable.wait(&lock);
+
+        while (!found.isEmpty() && (templates.size() < readBlockSize))
+            templates.append(found.takeFirst());
+        spaceAvailable.wakeAll();
+
+        *done = found.isEmpty() && finished;
+        passDone = *done;
         return templates;
     }
 
@@ -104,6 +233,183 @@ class crawlGallery : public Gallery
     {
         qFatal("Not supported");
     }
+
+    qint64 position()
+    {
+        QMutexLocker locker(&lock);
+        return emitted - found.size();
+    }
+
+    // Called with lock held
+    bool limitReached() const
+    {
+        return stopped || (emitted >= images) || (elapsed.elapsed()/1000 >= timeLimit);
+    }
+
+    // Called without lock held
+    bool shouldStop()
+    {
+        QMutexLocker locker(&lock);
+        return limitReached();
+    }
+
+    void walk()
+    {
+        QMutexLocker locker(&lock);
+        while (true) {
+            while (pendingDirectories.isEmpty() && (activeWalkers > 0) && !limitReached())
+                directoriesAvailable.wait(&lock);
+
+            if (pendingDirectories.isEmpty() || limitReached())
+                break;
+
+            const QPair<QString,int> directory = depthFirst ? pendingDirectories.takeLast() : pendingDirectories.takeFirst();
+            activeWalkers++;
+            locker.unlock();
+            list(directory.first, directory.second);
+            locker.relock();
+            activeWalkers--;
+        }
+
+        // The last walker out marks the crawl as complete
+        directoriesAvailable.wakeAll();
+        if ((activeWalkers == 0) && !completing) {
+            completing = true;
+            locker.unlock();
+            complete();
+        }
+    }
+
+    // Called without lock held, entries of path are at currentDepth
+    void list(const QString &path, int currentDepth)
+    {
+        if (currentDepth >= depth)
+            return;
+
+        const QFileInfo info(path);
+        if (!info.isDir())
+            return;
+        const qint64 modified = info.lastModified().toMSecsSinceEpoch();
+        record(path, Entry(-1, modified));
+
+        QList<QString> subdirectories;
+        const Entry last = previous.value(path);
+        if ((last.size == -1) && (last.modified == modified)) {
+            // Unchanged directory, its entries come from the manifest instead of a directory listing.
+            // Files are still stat'ed since editing a file doesn't update the modification time of its directory.
+            foreach (const QString &child, previousChildren.value(path)) {
+                if (previous.value(child).size == -1) {
+                    subdirectories.append(child);
+                } else if (suffixes.contains(QFileInfo(child).suffix().toLower())) {
+                    const QFileInfo childInfo(child);
+                    if (childInfo.exists())
+                        offer(child, childInfo.size(), childInfo.lastModified().toMSecsSinceEpoch());
+                }
+                if (shouldStop()) break;
+            }
+        } else {
+            QDirIterator it(path, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot);
+            while (it.hasNext()) {
+                it.next();
+                const QFileInfo child = it.fileInfo();
+                if (child.isDir()) subdirectories.append(child.canonicalFilePath());
+                else if (child.isFile() && suffixes.contains(child.suffix().toLower())) // Skips broken links
+                    offer(child.canonicalFilePath(), child.size(), child.lastModified().toMSecsSinceEpoch());
+                if (shouldStop()) break;
+            }
+        }
+
+        if (currentDepth + 1 >= depth)
+            return;
+
+        QMutexLocker locker(&lock);
+        foreach (const QString &subdirectory, subdirectories)
+            pendingDirectories.append(qMakePair(subdirectory, currentDepth + 1));
+        directoriesAvailable.wakeAll();
+    }
+
+    // Called without lock held, blocks while the queue is full
+    void offer(const QString &path, qint64 size, qint64 modified)
+    {
+        const Entry entry(size, modified);
+        record(path, entry);
+
+        if (incremental && previous.contains(path)) {
+            const Entry last = previous.value(path);
+            if ((last.size == size) && (last.modified == modified))
+                return;
+        }
+
+        File f;
+        if (json) f.set("URL", "file://"+path);
+        else      f.name = "file://"+path;
+
+        QMutexLocker locker(&lock);
+        while ((found.size() >= queueSize) && !stopped)
+            spaceAvailable.wait(&lock);
+        if (limitReached())
+            return;
+        found.append(f);
+        emitted++;
+        filesAvailable.wakeAll();
+    }
+
+    void complete()
+    {
+        if (manifestFile.isOpen()) {
+            QMutexLocker manifestLocker(&manifestLock);
+            manifestFile.close();
+
+            // An interrupted crawl leaves the previous manifest in place
+            if (shouldStop()) {
+                manifestFile.remove();
+            } else {
+                QFile::remove(manifest);
+                manifestFile.rename(manifest);
+            }
+        }
+
+        QMutexLocker locker(&lock);
+        finished = true;
+        filesAvailable.wakeAll();
+    }
+
+    void record(const QString &path, const Entry &entry)
+    {
+        if (!manifestFile.isOpen())
+            return;
+        const QByteArray line = (path + "\t" + QString::number(entry.size) + "\t" + QString::number(entry.modified) + "\n").toUtf8();
+        QMutexLocker locker(&manifestLock);
+        manifestFile.write(line);
+    }
+
+    void readManifest()
+    {
+        previous.clear();
+        previousChildren.clear();
+
+        QFile previousManifest(manifest);
+        if (!previousManifest.open(QFile::ReadOnly))
+            return;
+
+        // Listings crawled with another depth or other extensions are incomplete or include the wrong files,
+        // the file entries are still valid for incremental crawls
+        bool sameSettings = false;
+        while (!previousManifest.atEnd()) {
+            const QString line = QString::fromUtf8(previousManifest.readLine()).trimmed();
+            if (line.startsWith("#settings")) {
+                sameSettings = (line == manifestSettings());
+                continue;
+            }
+
+            const QStringList words = line.split('\t');
+            if (words.size() != 3)
+                continue;
+            previous.insert(words[0], Entry(words[1].toLongLong(), words[2].toLongLong()));
+            if (sameSettings)
+                previousChildren[QFileInfo(words[0]).path()].append(words[0]);
+        }
+    }
 };
 
 BR_REGISTER(Gallery, crawlGallery)
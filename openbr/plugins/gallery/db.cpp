@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QThread>
+#include <QWaitCondition>
 #include <QtSql>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -22,79 +24,253 @@
 namespace br
 {
 
+#ifndef BR_EMBEDDED
+// Runs calls one at a time on a thread of its own
+class CallThread : public QThread
+{
+public:
+    struct Call
+    {
+        virtual ~Call() {}
+        virtual void run() = 0;
+    };
+
+    CallThread() : pending(NULL), stopping(false)
+    {
+        start();
+    }
+
+    ~CallThread()
+    {
+        {
+            QMutexLocker locker(&lock);
+            stopping = true;
+            available.wakeAll();
+        }
+        wait();
+    }
+
+    // Returns once call has run
+    void call(Call &call)
+    {
+        QMutexLocker serial(&callLock);
+        QMutexLocker locker(&lock);
+        pending = &call;
+        available.wakeAll();
+        while (pending)
+            returned.wait(&lock);
+    }
+
+private:
+    QMutex callLock, lock;
+    QWaitCondition available, returned;
+    Call *pending;
+    bool stopping;
+
+    void run()
+    {
+        QMutexLocker locker(&lock);
+        while (true) {
+            while (!pending && !stopping)
+                available.wait(&lock);
+            if (!pending)
+                return;
+
+            locker.unlock();
+            pending->run();
+            locker.relock();
+            pending = NULL;
+            returned.wakeAll();
+        }
+    }
+};
+#endif // BR_EMBEDDED
+
 /*!
  * \ingroup galleries
- * \brief Database input.
+ * \brief Database input and output.
+ *
+ * A single connection is held open for the lifetime of the gallery.
+ * Qt only supports using a connection on the thread that opened it, so the connection is opened and used on a thread owned by the gallery,
+ * readBlock() and write() may then be called from any thread.
+ * Without a \c subset, the \c query is executed once per pass as a forward-only cursor and rows are streamed \c readBlockSize at a time in query order.
+ * A \c subset groups rows by label and therefore still reads the complete result before sampling.
+ * Templates are written to \c table (default \c templates) with columns \c File, \c Label and \c Metadata, in transactions of \c readBlockSize rows.
  * \author Josh Klontz \cite jklontz
  */
 class dbGallery : public Gallery
 {
     Q_OBJECT
 
+#ifndef BR_EMBEDDED
+    QSqlDatabase db;
+    QSqlQuery *cursor;
+    QString labelName;
+    bool hasMetadata, hasFilter, grouped;
+    QList<QVariantList> pending; // Buffered writes, one list per column
+    CallThread *connectionThread; // Every use of db happens here
+
+    // Calls the member function of a gallery on its connection thread
+    struct MemberCall : public CallThread::Call
+    {
+        dbGallery *gallery;
+        void (dbGallery::*function)();
+        MemberCall(dbGallery *gallery_, void (dbGallery::*function_)()) : gallery(gallery_), function(function_) {}
+        void run() { (gallery->*function)(); }
+    };
+
+    struct ReadBlockCall : public CallThread::Call
+    {
+        dbGallery *gallery;
+        bool *done;
+        TemplateList result;
+        ReadBlockCall(dbGallery *gallery_, bool *done_) : gallery(gallery_), done(done_) {}
+        void run() { result = gallery->_readBlock(done); }
+    };
+
+    struct WriteCall : public CallThread::Call
+    {
+        dbGallery *gallery;
+        const Template &t;
+        WriteCall(dbGallery *gallery_, const Template &t_) : gallery(gallery_), t(t_) {}
+        void run() { gallery->_write(t); }
+    };
+
+    ~dbGallery()
+    {
+        MemberCall call(this, &dbGallery::_disconnect);
+        connectionThread->call(call);
+        delete connectionThread;
+    }
+
+    void init()
+    {
+        cursor = NULL;
+        grouped = false;
+        connectionThread = new CallThread();
+        MemberCall call(this, &dbGallery::_connect);
+        connectionThread->call(call);
+    }
+
     TemplateList readBlock(bool *done)
     {
-        TemplateList templates;
-        br::File import = file.get<QString>("import", "");
-        QString query = file.get<QString>("query");
-        QString subset = file.get<QString>("subset", "");
+        ReadBlockCall call(this, done);
+        connectionThread->call(call);
+        return call.result;
+    }
 
-#ifndef BR_EMBEDDED
-        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
+    void write(const Template &t)
+    {
+        WriteCall call(this, t);
+        connectionThread->call(call);
+    }
+
+    void _connect()
+    {
+        // Each gallery gets its own named connection so that galleries on different threads don't share one
+        db = QSqlDatabase::addDatabase("QSQLITE", QString("dbGallery_%1").arg(quintptr(this)));
         db.setDatabaseName(file);
         if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
 
-        if (!import.isNull()) {
-            qDebug("Parsing %s", qPrintable(import.name));
-            QStringList lines = QtUtils::readLines(import);
-            QList<QStringList> cells; cells.reserve(lines.size());
-            const QRegExp re("\\s*,\\s*");
-            foreach (const QString &line, lines) {
-                cells.append(line.split(re));
-                if (cells.last().size() != cells.first().size()) qFatal("Column count mismatch.");
-            }
+        const br::File import = file.get<QString>("import", "");
+        if (!import.isNull())
+            importTable(import);
+    }
 
-            QStringList columns, qMarks;
-            QList<QVariantList> variantLists;
-            for (int i=0; i<cells[0].size(); i++) {
-                bool isNumeric;
-                cells[1][i].toInt(&isNumeric);
-                columns.append(cells[0][i] + (isNumeric ? " INTEGER" : " STRING"));
-                qMarks.append("?");
-
-                QVariantList variantList; variantList.reserve(lines.size()-1);
-                for (int j=1; j<lines.size(); j++) {
-                    if (isNumeric) variantList << cells[j][i].toInt();
-                    else           variantList << cells[j][i];
-                }
-                variantLists.append(variantList);
-            }
+    void _disconnect()
+    {
+        flush();
+        delete cursor;
+        const QString connection = db.connectionName();
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(connection);
+    }
 
-            const QString &table = import.baseName();
-            qDebug("Creating table %s", qPrintable(table));
-            QSqlQuery q(db);
-            if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
-                qFatal("%s.", qPrintable(q.lastError().text()));
-            if (!q.prepare("insert into " + table + " values (" + qMarks.join(", ") + ")"))
-                qFatal("%s.", qPrintable(q.lastError().text()));
-            foreach (const QVariantList &vl, variantLists)
-                q.addBindValue(vl);
-            if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
+    void importTable(const br::File &import)
+    {
+        qDebug("Parsing %s", qPrintable(import.name));
+        QStringList lines = QtUtils::readLines(import);
+        QList<QStringList> cells; cells.reserve(lines.size());
+        const QRegExp re("\\s*,\\s*");
+        foreach (const QString &line, lines) {
+            cells.append(line.split(re));
+            if (cells.last().size() != cells.first().size()) qFatal("Column count mismatch.");
+        }
+
+        QStringList columns, qMarks;
+        QList<QVariantList> variantLists;
+        for (int i=0; i<cells[0].size(); i++) {
+            bool isNumeric;
+            cells[1][i].toInt(&isNumeric);
+            columns.append(cells[0][i] + (isNumeric ? " INTEGER" : " STRING"));
+            qMarks.append("?");
+
+            QVariantList variantList; variantList.reserve(lines.size()-1);
+            for (int j=1; j<lines.size(); j++) {
+                if (isNumeric) variantList << cells[j][i].toInt();
+                else           variantList << cells[j][i];
+            }
+            variantLists.append(variantList);
         }
 
+        const QString &table = import.baseName();
+        qDebug("Creating table %s", qPrintable(table));
         QSqlQuery q(db);
+        if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        insert(q, "insert into " + table + " values (" + qMarks.join(", ") + ")", variantLists);
+    }
+
+    // Batched insert inside a single transaction
+    void insert(QSqlQuery &q, const QString &statement, const QList<QVariantList> &variantLists)
+    {
+        if (!db.transaction()) qFatal("%s.", qPrintable(db.lastError().text()));
+        if (!q.prepare(statement))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        foreach (const QVariantList &vl, variantLists)
+            q.addBindValue(vl);
+        if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
+        if (!db.commit()) qFatal("%s.", qPrintable(db.lastError().text()));
+    }
+
+    void open()
+    {
+        QString query = file.get<QString>("query");
         if (query.startsWith('\'') && query.endsWith('\''))
             query = query.mid(1, query.size()-2);
-        if (!q.exec(query))
-            qFatal("%s.", qPrintable(q.lastError().text()));
 
-        if ((q.record().count() == 0) || (q.record().count() > 3))
-            qFatal("Query record expected one to three fields, got %d.", q.record().count());
-        const bool hasMetadata = (q.record().count() >= 2);
-        const bool hasFilter = (q.record().count() >= 3);
+        cursor = new QSqlQuery(db);
+        cursor->setForwardOnly(true);
+        if (!cursor->prepare(query) || !cursor->exec())
+            qFatal("%s.", qPrintable(cursor->lastError().text()));
 
-        QString labelName = "Label";
-        if (q.record().count() >= 2)
-            labelName = q.record().fieldName(1);
+        const QSqlRecord record = cursor->record();
+        if ((record.count() == 0) || (record.count() > 3))
+            qFatal("Query record expected one to three fields, got %d.", record.count());
+        hasMetadata = (record.count() >= 2);
+        hasFilter = (record.count() >= 3);
+        labelName = hasMetadata ? record.fieldName(1) : QString("Label");
+        grouped = hasFilter || !file.get<QString>("subset", "").isEmpty();
+    }
+
+    TemplateList readStream(bool *done)
+    {
+        TemplateList templates;
+        while ((templates.size() < readBlockSize) && cursor->next()) {
+            templates.append(File(cursor->value(0).toString()));
+            templates.last().file.set(labelName, hasMetadata ? cursor->value(1).toString() : QString());
+        }
+        *done = (templates.size() < readBlockSize);
+        if (*done)
+            cursor->finish();
+        return templates;
+    }
+
+    TemplateList readGrouped()
+    {
+        TemplateList templates;
+        QString subset = file.get<QString>("subset", "");
 
         // subset = seed:subjectMaxSize:numSubjects:subjectMinSize or
         // subset = seed:{Metadata,...,Metadata}:numSubjects
@@ -121,6 +297,7 @@ class dbGallery : public Gallery
 
         typedef QPair<QString,QString> Entry; // QPair<File,Metadata>
         QHash<QString, QList<Entry> > entries; // QHash<Label, QList<Entry> >
+        QSqlQuery &q = *cursor;
         while (q.next()) {
             if (hasFilter && (seed >= 0) && (qHash(q.value(2).toString()) % 2 != (uint)seed % 2)) continue; // Ensures training and testing filters don't overlap
 
@@ -129,6 +306,7 @@ class dbGallery : public Gallery
             else
                 entries[hasFilter ? q.value(2).toString() : ""].append(QPair<QString,QString>(q.value(0).toString(), hasMetadata ? q.value(1).toString() : ""));
         }
+        q.finish();
 
         QStringList labels = entries.keys();
         qSort(labels);
@@ -166,23 +344,66 @@ class dbGallery : public Gallery
             }
         }
 
-        db.close();
-#endif // BR_EMBEDDED
+        return templates;
+    }
+
+    TemplateList _readBlock(bool *done)
+    {
+        if (cursor == NULL)
+            open();
+        else if (!cursor->isActive() && !cursor->exec()) // Previous pass finished the cursor, start a new one
+            qFatal("%s.", qPrintable(cursor->lastError().text()));
+
+        if (!grouped)
+            return readStream(done);
 
         *done = true;
-        return templates;
+        return readGrouped();
     }
 
-    void write(const Template &t)
+    void _write(const Template &t)
     {
-        (void) t;
-        qFatal("Not supported.");
+        if (pending.isEmpty()) {
+            QSqlQuery q(db);
+            if (!q.exec("CREATE TABLE IF NOT EXISTS " + table() + " (File STRING, Label STRING, Metadata STRING);"))
+                qFatal("%s.", qPrintable(q.lastError().text()));
+            pending << QVariantList() << QVariantList() << QVariantList();
+        }
+
+        pending[0] << t.file.name;
+        pending[1] << t.file.get<QString>("Label", "");
+        pending[2] << t.file.flat();
+        if (pending[0].size() >= readBlockSize)
+            flush();
     }
 
-    void init()
+    void flush()
+    {
+        if (pending.isEmpty() || pending[0].isEmpty())
+            return;
+        QSqlQuery q(db);
+        insert(q, "insert into " + table() + " values (?, ?, ?)", pending);
+        for (int i=0; i<pending.size(); i++)
+            pending[i].clear();
+    }
+
+    QString table() const
+    {
+        return file.get<QString>("table", "templates");
+    }
+#else // BR_EMBEDDED
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        return TemplateList();
+    }
+
+    void write(const Template &t)
     {
-        //
+        (void) t;
+        qFatal("Not supported.");
     }
+#endif // BR_EMBEDDED
 };
 
 BR_REGISTER(Gallery, dbGallery)
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMutex>
+#include <QSet>
 #include <openbr/plugins/openbr_internal.h>
 
 namespace br
@@ -22,6 +24,10 @@ namespace br
 /*!
  * \ingroup initializers
  * \brief Initialization support for memGallery.
+ *
+ * Galleries are accounted for in bytes (matrix data plus metadata) and evicted in least recently used order
+ * once br::Context::memGalleryBudget is exceeded. Only galleries that can be reloaded, those read from a backing \c .gal file, are evicted.
+ * Galleries built with Gallery::write() and pinned galleries stay in memory. A gallery can be pinned before it is loaded.
  * \author Josh Klontz \cite jklontz
  */
 class MemoryGalleries : public Initializer
@@ -32,20 +38,137 @@ class MemoryGalleries : public Initializer
 
     void finalize() const
     {
+        QMutexLocker locker(&lock);
         galleries.clear();
+        pinned.clear();
+        totalBytes = 0;
     }
 
 public:
-    static QHash<File, TemplateList> galleries; /*!< TODO */
+    struct Entry
+    {
+        QSharedPointer<TemplateList> templates;
+        qint64 bytes;
+        qint64 lastUsed;
+        bool reloadable; // Every template came from a backing file
+
+        Entry() : templates(new TemplateList()), bytes(0), lastUsed(0), reloadable(false) {}
+    };
+
+    static QHash<File, Entry> galleries; /*!< \brief Galleries held in memory. */
+    static QSet<File> pinned; /*!< \brief Galleries exempt from eviction, loaded or not. */
+    static QMutex lock; /*!< \brief Guards #galleries and the byte accounting. */
+    static qint64 totalBytes; /*!< \brief Sum of Entry::bytes over #galleries. */
+    static qint64 clock; /*!< \brief Monotonic counter used to order accesses. */
+
+    static bool contains(const File &gallery)
+    {
+        QMutexLocker locker(&lock);
+        return galleries.contains(gallery);
+    }
+
+    // Returns a shared reference to the gallery, which remains valid even if the gallery is later evicted.
+    static QSharedPointer<TemplateList> acquire(const File &gallery)
+    {
+        QMutexLocker locker(&lock);
+        if (!galleries.contains(gallery)) return QSharedPointer<TemplateList>(new TemplateList());
+        Entry &entry = galleries[gallery];
+        entry.lastUsed = ++clock;
+        return entry.templates;
+    }
+
+    static void append(const File &gallery, const TemplateList &templates, bool reloadable = false)
+    {
+        QMutexLocker locker(&lock);
+        const bool existed = galleries.contains(gallery);
+        Entry &entry = galleries[gallery];
+        entry.reloadable = reloadable && (!existed || entry.reloadable);
+        qint64 newBytes = 0;
+        foreach (const Template &t, templates)
+            newBytes += bytes(t);
+        entry.templates->append(templates);
+        entry.bytes += newBytes;
+        entry.lastUsed = ++clock;
+        totalBytes += newBytes;
+        evict(gallery);
+    }
+
+    static void pin(const File &gallery, bool pin)
+    {
+        QMutexLocker locker(&lock);
+        if (pin) {
+            pinned.insert(gallery);
+        } else {
+            pinned.remove(gallery);
+            evict(File());
+        }
+    }
+
+    static void drop(const File &gallery)
+    {
+        QMutexLocker locker(&lock);
+        if (!galleries.contains(gallery)) return;
+        totalBytes -= galleries[gallery].bytes;
+        galleries.remove(gallery);
+    }
+
+    // Estimated resident size of a template, matrix data plus metadata.
+    static qint64 bytes(const Template &t)
+    {
+        qint64 size = sizeof(Template) + t.size() * sizeof(cv::Mat) + t.bytes() + t.file.name.size() * sizeof(QChar);
+        const QVariantMap metadata = t.file.localMetadata();
+        for (QVariantMap::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it) {
+            size += sizeof(QVariant) + it.key().size() * sizeof(QChar);
+            if (it.value().type() == QVariant::String) size += it.value().toString().size() * sizeof(QChar);
+            else if (it.value().type() == QVariant::List) size += it.value().toList().size() * sizeof(QVariant);
+        }
+        return size;
+    }
+
+private:
+    // Caller must hold lock, the gallery in keep is never evicted.
+    static void evict(const File &keep)
+    {
+        const qint64 budget = qint64(Globals->memGalleryBudget) * 1024 * 1024;
+        if (budget <= 0) return;
+
+        while (totalBytes > budget) {
+            QHash<File, Entry>::iterator victim = galleries.end();
+            for (QHash<File, Entry>::iterator it = galleries.begin(); it != galleries.end(); ++it)
+                if (it.value().reloadable && !pinned.contains(it.key()) && (it.key() != keep) && ((victim == galleries.end()) || (it.value().lastUsed < victim.value().lastUsed)))
+                    victim = it;
+            if (victim == galleries.end()) return;
+
+            qDebug("Evicting %s from memory.", qPrintable(victim.key().flat()));
+            totalBytes -= victim.value().bytes;
+            galleries.erase(victim);
+        }
+    }
 };
 
-QHash<File, TemplateList> MemoryGalleries::galleries;
+QHash<File, MemoryGalleries::Entry> MemoryGalleries::galleries;
+QSet<File> MemoryGalleries::pinned;
+QMutex MemoryGalleries::lock;
+qint64 MemoryGalleries::totalBytes = 0;
+qint64 MemoryGalleries::clock = 0;
 
 BR_REGISTER(Initializer, MemoryGalleries)
 
+void pinMemoryGallery(const File &gallery, bool pinned)
+{
+    MemoryGalleries::pin(gallery, pinned);
+}
+
+void dropMemoryGallery(const File &gallery)
+{
+    MemoryGalleries::drop(gallery);
+}
+
 /*!
  * \ingroup galleries
  * \brief A gallery held in memory.
+ *
+ * Blocks are handed out as shallow copies that share matrix data with the stored gallery.
  * \author Josh Klontz \cite jklontz
  */
 class memGallery : public Gallery
@@ -53,33 +176,52 @@ class memGallery : public Gallery
     Q_OBJECT
     int block;
     qint64 gallerySize;
+    QSharedPointer<TemplateList> templates;
 
     void init()
     {
         block = 0;
+        load();
+        gallerySize = MemoryGalleries::acquire(file)->size();
+    }
+
+    // Reads the backing .gal file unless the gallery is already in memory, also after it was evicted
+    void load()
+    {
         File galleryFile = file.name.mid(0, file.name.size()-4);
-        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::galleries.contains(file)) {
+        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::contains(file)) {
             QSharedPointer<Gallery> gallery(Factory<Gallery>::make(galleryFile));
-            MemoryGalleries::galleries[file] = gallery->read();
-            gallerySize = MemoryGalleries::galleries[file].size();
+            MemoryGalleries::append(file, gallery->read(), true);
         }
     }
 
     TemplateList readBlock(bool *done)
     {
-        TemplateList templates = MemoryGalleries::galleries[file].mid(block*readBlockSize, readBlockSize);
-        for (qint64 i = 0; i < templates.size();i++) {
-            templates[i].file.set("progress", i + block * readBlockSize);
+        // Hold a reference for the duration of the read so eviction can't pull the gallery out from under us
+        if (block == 0) {
+            load();
+            templates = MemoryGalleries::acquire(file);
+        }
+
+        TemplateList result;
+        {
+            QMutexLocker locker(&MemoryGalleries::lock);
+            result = templates->mid(block*readBlockSize, readBlockSize);
+        }
+
+        for (qint64 i = 0; i < result.size();i++) {
+            result[i].file.set("progress", i + block * readBlockSize);
         }
 
-        *done = (templates.size() < readBlockSize);
+        *done = (result.size() < readBlockSize);
         block = *done ? 0 : block+1;
-        return templates;
+        if (*done) templates.clear();
+        return result;
     }
 
     void write(const Template &t)
     {
-        MemoryGalleries::galleries[file].append(t);
+        MemoryGalleries::append(file, TemplateList() << t);
     }
 
     qint64 totalSize()
@@ -107,39 +249,18 @@ FileList FileList::fromGallery(const File &rFile, bool cache)
     FileList fileData;
 
     // Did we already read the data?
-    if (MemoryGalleries::galleries.contains(targetMeta))
+    if (MemoryGalleries::contains(targetMeta))
     {
-        return MemoryGalleries::galleries[targetMeta].files();
+        return MemoryGalleries::acquire(targetMeta)->files();
     }
 
-    TemplateList templates;
-    // OK we read the data in some form, does the gallery type containing matrices?
-    if ((QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
-        // Retrieve it block by block, dropping matrices from read templates.
-        QScopedPointer<Gallery> gallery(Gallery::make(file));
-        gallery->set_readBlockSize(10);
-        bool done = false;
-        while (!done)
-        {
-            TemplateList tList = gallery->readBlock(&done);
-            for (int i=0; i < tList.size();i++)
-            {
-                tList[i].clear();
-                templates.append(tList[i].file);
-            }
-        }
-    }
-    else {
-        // this is a gallery format that doesn't include matrices, so we can just read it
-        QScopedPointer<Gallery> gallery(Gallery::make(file));
-        templates= gallery->read();
-    }
+    // Galleries containing matrices skip over them where the format allows
+    QScopedPointer<Gallery> gallery(Gallery::make(file));
+    TemplateList templates(gallery->files());
 
+    // Evictable, a later call reads the gallery again
     if (cache)
-    {
-        QScopedPointer<Gallery> memOutput(Gallery::make(targetMeta));
-        memOutput->writeBlock(templates);
-    }
+        MemoryGalleries::append(targetMeta, templates, true);
     fileData = templates.files();
     return fileData;
 }
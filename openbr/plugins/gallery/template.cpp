@@ -37,6 +37,12 @@ class templateGallery : public Gallery
         return TemplateList() << Template(file, cv::Mat(1, data.size(), CV_8UC1, data.data()).clone());
     }
 
+    FileList readFiles(bool *done)
+    {
+        *done = true;
+        return FileList() << file;
+    }
+
     void write(const Template &t)
     {
         (void) t;
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QThread>
+#include <QWaitCondition>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -22,14 +24,37 @@
 namespace br
 {
 
-// Read a video frame by frame using cv::VideoCapture
+// Read a video frame by frame using cv::VideoCapture.
+// Frames are decoded ahead of the consumer on a dedicated thread into a ring of
+// bufferSize reusable matrices. A slot is overwritten only once every template
+// referencing it has been released, otherwise it is replaced by a fresh allocation.
 class videoGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(int bufferSize READ get_bufferSize WRITE set_bufferSize RESET reset_bufferSize STORED false)
+    BR_PROPERTY(int, bufferSize, 32)
+
+    class Decoder : public QThread
+    {
+        videoGallery *gallery;
+    public:
+        Decoder(videoGallery *gallery_) : gallery(gallery_) {}
+        void run() { gallery->decode(); }
+    };
+
 public:
     qint64 idx;
+
+    videoGallery() : decoder(this), started(false), finished(false), stopped(false) {}
+
     ~videoGallery()
     {
+        {
+            QMutexLocker locker(&lock);
+            stopped = true;
+            spaceAvailable.wakeAll();
+        }
+        decoder.wait();
         video.release();
     }
 
@@ -45,40 +70,38 @@ public:
 
     TemplateList readBlock(bool *done)
     {
-        if (!video.isOpened()) {
-            // opening videos appears to not be thread safe on windows
-            QMutexLocker lock(&openLock);
-
-            deferredInit();
+        // Each pass reopens the video, the decoder released it at the end of the previous one
+        if (!started) {
+            decoder.wait();
+            started = true;
+            finished = false;
+            ready.clear();
             idx = 0;
+            frames.clear();
+            for (int i=0; i<std::max(1, bufferSize); i++)
+                frames.append(cv::Mat());
+            decoder.start();
         }
 
-        Template output;
-        output.file = file;
-        output.m() = cv::Mat();
-
-        cv::Mat temp;
-        bool res = video.read(temp);
-
-        if (!res) {
-            // The video capture broke, return an empty list.
-            output.m() = cv::Mat();
-            video.release();
-            *done = true;
-            return TemplateList();
+        TemplateList rVal;
+        QMutexLocker locker(&lock);
+        while (ready.isEmpty() && !finished)
+            framesAvailable.wait(&lock);
+
+        while (!ready.isEmpty() && (rVal.size() < readBlockSize)) {
+            Template output;
+            output.file = file;
+            // Shares the ring buffer's data, the slot isn't reused until this reference is dropped
+            output.m() = frames.at(ready.takeFirst());
+            output.file.set("progress", idx);
+            idx++;
+            rVal.append(output);
         }
+        spaceAvailable.wakeAll();
 
-        // This clone is critical, if we don't do it then the output matrix will
-        // be an alias of an internal buffer of the video source, leading to various
-        // problems later.
-        output.m() = temp.clone();
-
-        output.file.set("progress", idx);
-        idx++;
-
-        TemplateList rVal;
-        rVal.append(temp);
-        *done = false;
+        *done = ready.isEmpty() && finished;
+        if (*done)
+            started = false;
         return rVal;
     }
 
@@ -89,6 +112,65 @@ public:
 
 protected:
     cv::VideoCapture video;
+
+private:
+    Decoder decoder;
+    QList<cv::Mat> frames; // Ring buffer
+    QList<int> ready; // Decoded slots not yet handed out, in frame order
+    QMutex lock;
+    QWaitCondition framesAvailable, spaceAvailable;
+    bool started, finished, stopped;
+
+    static bool released(const cv::Mat &m)
+    {
+        return !m.refcount || (*m.refcount == 1);
+    }
+
+    void decode()
+    {
+        {
+#ifdef _WIN32
+            // opening videos appears to not be thread safe on windows
+            QMutexLocker openLocker(&openLock);
+#endif // _WIN32
+            deferredInit();
+        }
+
+        int next = 0;
+        cv::Mat temp;
+        while (true) {
+            {
+                QMutexLocker locker(&lock);
+                while ((ready.size() >= frames.size()) && !stopped)
+                    spaceAvailable.wait(&lock);
+                if (stopped)
+                    break;
+            }
+
+            // Decoding happens outside the lock so it overlaps with the consumer
+            if (!video.read(temp))
+                break;
+
+            // The slot is still referenced downstream, leave that data to its owner
+            cv::Mat &frame = frames[next];
+            if (!released(frame))
+                frame = cv::Mat();
+
+            // This copy is critical, temp is an alias of an internal buffer of the video source.
+            // copyTo() only reallocates the slot if the frame geometry changed.
+            temp.copyTo(frame);
+
+            QMutexLocker locker(&lock);
+            ready.append(next);
+            next = (next + 1) % frames.size();
+            framesAvailable.wakeAll();
+        }
+
+        video.release();
+        QMutexLocker locker(&lock);
+        finished = true;
+        framesAvailable.wakeAll();
+    }
 };
 
 BR_REGISTER(Gallery,videoGallery)
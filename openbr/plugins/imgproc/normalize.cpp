@@ -80,6 +80,11 @@ private:
         }
 
     }
+
+    bool batchable() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Transform, NormalizeTransform)
@@ -47,6 +47,11 @@ class QuantizeTransform : public Transform
     {
         src.m().convertTo(dst, CV_8U, a, b);
     }
+
+    bool batchable() const
+    {
+        return true;
+    }
 };
 
 BR_REGISTER(Transform, QuantizeTransform)
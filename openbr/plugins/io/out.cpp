@@ -45,15 +45,18 @@ class OutputTransform : public TimeVaryingTransform
         foreach (const Template &t, dst) {
             bool fte = t.file.getBool("FTE") || t.file.fte;
 
-            for (int i=0; i < scoresPerMat; i++) {
-                output->setRelative(fte ? -std::numeric_limits<float>::max() : t.m().at<float>(0, i), currentRow, currentCol);
-
-                // row-major input
-                if (!transposeMode)
-                    currentCol++;
-                // col-major input
-                else
-                    currentRow++;
+            const cv::Mat scores = fte ? cv::Mat(1, scoresPerMat, CV_32FC1, cv::Scalar(-std::numeric_limits<float>::max()))
+                                       : t.m().row(0).colRange(0, scoresPerMat);
+
+            // row-major input
+            if (!transposeMode) {
+                output->setBlockScores(currentRow, currentCol, scores);
+                currentCol += scoresPerMat;
+            }
+            // col-major input
+            else {
+                output->setBlockScores(currentRow, currentCol, scores.t());
+                currentRow += scoresPerMat;
             }
             // filled in a row, advance to the next, reset column position
             if (!transposeMode) {
@@ -36,7 +36,7 @@ class GroundTruthTransform : public UntrainableMetadataTransform
 
     void init()
     {
-        foreach (const File &file, TemplateList::fromGallery(groundTruth).files())
+        foreach (const File &file, TemplateList::fromGallery(groundTruth, false).files())
             files.insert(file.baseName(), file);
     }
 
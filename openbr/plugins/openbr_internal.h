@@ -449,9 +449,76 @@ public:
 
 };
 
+/*!
+ * \brief A br::Output that receives the similarity matrix one query row at a time.
+ *
+ * Scores are accumulated into per-row state created by makeRow() until every score of the row is set.
+ * The default state buffers the full row for setRow(), so memory is proportional to the rows in flight,
+ * which is the whole matrix when targets arrive a few at a time, as when a larger target gallery is streamed.
+ * Derived classes that only need a summary of each row should override makeRow(), addScores() and finishRow()
+ * to keep bounded state instead.
+ */
+class RowOutput : public Output
+{
+    Q_OBJECT
+public:
+    virtual ~RowOutput();
+    void initialize(const FileList &targetFiles, const FileList &queryFiles);
+
+    /*!
+     * \brief The accumulated state of one query row.
+     */
+    struct Row
+    {
+        int count; // Scores added so far
+        Row() : count(0) {}
+        virtual ~Row() {}
+    };
+
+protected:
+    /*!
+     * \brief Creates the state of query row \em i when its first scores arrive, the default buffers every score.
+     */
+    virtual Row *makeRow(int i);
+
+    /*!
+     * \brief Adds \em count scores of query row \em i starting at target \em j, called with the row locked.
+     */
+    virtual void addScores(Row *row, int i, int j, const float *scores, int count);
+
+    /*!
+     * \brief Called once per query row when all of its scores are added, possibly concurrently for different rows.
+     */
+    virtual void finishRow(Row *row, int i);
+
+    /*!
+     * \brief Called by the default finishRow() with the buffered scores of query row \em i.
+     */
+    virtual void setRow(int i, const QVector<float> &scores);
+
+    /*!
+     * \brief Finishes incomplete rows, derived destructors should call this first.
+     *
+     * Unset scores are -FLT_MAX in rows passed to setRow().
+     */
+    void finalize();
+
+private:
+    static const int Stripes = 64;
+    QVector<Row*> rows;
+    QMutex locks[Stripes];
+
+    void set(float value, int i, int j);
+    void setScores(const cv::Mat &scores, int i, int j);
+    void add(int i, int j, const float *scores, int count);
+};
 
 void applyAdditionalProperties(const File &temp, Transform *target);
 
+// Implemented in plugins/gallery/mem.cpp
+BR_EXPORT void pinMemoryGallery(const File &gallery, bool pinned);
+BR_EXPORT void dropMemoryGallery(const File &gallery);
+
 
 inline void splitFTEs(TemplateList &src, TemplateList  &ftes)
 {
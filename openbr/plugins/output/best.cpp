@@ -65,6 +65,20 @@ class bestOutput : public Output
             lock.unlock();
         }
     }
+
+    void setScores(const cv::Mat &scores, int i, int j)
+    {
+        for (int r=0; r<scores.rows; r++) {
+            // Best of the tile row, skipping the self similarity score
+            const float *row = scores.ptr<float>(r);
+            int best = -1;
+            for (int c=0; c<scores.cols; c++)
+                if (!(selfSimilar && (i+r == j+c)) && ((best == -1) || (row[c] > row[best])))
+                    best = c;
+            if (best != -1)
+                set(row[best], i+r, j+best);
+        }
+    }
 };
 
 BR_REGISTER(Output, bestOutput)
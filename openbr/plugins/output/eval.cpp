@@ -40,8 +40,8 @@ class evalOutput : public MatrixOutput
 
     ~evalOutput()
     {
-        if (!target.isEmpty()) targetFiles = TemplateList::fromGallery(target).files();
-        if (!query.isEmpty())  queryFiles  = TemplateList::fromGallery(query).files();
+        if (!target.isEmpty()) targetFiles = TemplateList::fromGallery(target, false).files();
+        if (!query.isEmpty())  queryFiles  = TemplateList::fromGallery(query, false).files();
 
         if (data.data) {
             const QString csv = QString(file.name).replace(".eval", ".csv");
@@ -23,44 +23,167 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief One score per row.
+ *
+ * Rows are streamed to disk in query order as soon as each row of the similarity matrix completes.
+ * With \c binary set, columns are instead written as raw little-endian arrays next to \em file:
+ * \c .query and \c .target (\c int32 indices), \c .mask (\c uint8) and \c .score (\c float32),
+ * with the indices resolved by the \c .files table.
  * \author Josh Klontz \cite jklontz
  */
-class meltOutput : public MatrixOutput
+class meltOutput : public RowOutput
 {
     Q_OBJECT
 
+    enum Column { QueryColumn, TargetColumn, MaskColumn, ScoreColumn, Columns };
+
+    bool genuineOnly, impostorOnly, binary;
+    QString values;
+    QVector<int> queryLabels, targetLabels;
+
+    // Guarded by writeLock, completed rows are written in query order
+    QMutex writeLock;
+    QMap<int, QList<QByteArray> > pendingRows;
+    int nextRow;
+    QFile f, columns[Columns];
+    QByteArray buffer; // For terminal and buffer outputs
+
     ~meltOutput()
     {
+        finalize();
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const bool genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
-        const bool impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+
+        if (file.baseName() == "buffer") {
+            if (buffer.endsWith('\n')) buffer.chop(1);
+            Globals->buffer = buffer;
+        }
+        f.close();
+        for (int c=0; c<Columns; c++)
+            columns[c].close();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        // Output::make() and OutputTransform both initialize, start over on each call
+        f.close();
+        for (int c=0; c<Columns; c++)
+            columns[c].close();
+
+        RowOutput::initialize(targetFiles, queryFiles);
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
+
+        genuineOnly = file.contains("Genuine") && !file.contains("Impostor");
+        impostorOnly = file.contains("Impostor") && !file.contains("Genuine");
+        binary = file.getBool("binary");
 
         QMap<QString,QVariant> args = file.localMetadata();
         args.remove("Genuine");
         args.remove("Impostor");
+        args.remove("binary");
 
         QString keys; foreach (const QString &key, args.keys()) keys += "," + key;
-        QString values; foreach (const QVariant &value, args.values()) values += "," + value.toString();
+        values.clear(); foreach (const QVariant &value, args.values()) values += "," + value.toString();
 
-        QStringList lines;
-        if (file.baseName() != "terminal") lines.append(QString("Query,Target,Mask,Similarity%1").arg(keys));
+        // Labels are compared as integer ids
+        QHash<QString,int> ids;
+        queryLabels.clear();
+        foreach (const QString &label, File::get<QString>(queryFiles, "Label")) {
+            if (!ids.contains(label)) ids.insert(label, ids.size());
+            queryLabels.append(ids[label]);
+        }
+        targetLabels.clear();
+        foreach (const QString &label, File::get<QString>(targetFiles, "Label")) {
+            if (!ids.contains(label)) ids.insert(label, ids.size());
+            targetLabels.append(ids[label]);
+        }
+
+        pendingRows.clear();
+        nextRow = 0;
+        buffer.clear();
 
-        QList<QString> queryLabels = File::get<QString>(queryFiles, "Label");
-        QList<QString> targetLabels = File::get<QString>(targetFiles, "Label");
+        if (binary) {
+            const char *suffixes[Columns] = { ".query", ".target", ".mask", ".score" };
+            for (int c=0; c<Columns; c++)
+                open(columns[c], file.name + suffixes[c]);
 
-        for (int i=0; i<queryFiles.size(); i++) {
+            QStringList table;
+            table.append("Index,Role,File,Label");
+            for (int i=0; i<queryFiles.size(); i++)
+                table.append(QString("%1,Query,%2,%3").arg(QString::number(i), queryFiles[i].name, queryFiles[i].get<QString>("Label")));
+            for (int j=0; j<targetFiles.size(); j++)
+                table.append(QString("%1,Target,%2,%3").arg(QString::number(j), targetFiles[j].name, targetFiles[j].get<QString>("Label")));
+            QtUtils::writeFile(file.name + ".files", table);
+        } else {
+            const QByteArray header = QString("Query,Target,Mask,Similarity%1\n").arg(keys).toLocal8Bit();
+            if (file.baseName() == "terminal") {
+                // No header
+            } else if (file.baseName() == "buffer") {
+                buffer.append(header);
+            } else {
+                open(f, file);
+                f.write(header);
+            }
+        }
+    }
+
+    void open(QFile &output, const QString &fileName)
+    {
+        output.setFileName(fileName);
+        QtUtils::touchDir(output);
+        if (!output.open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(fileName));
+    }
+
+    void setRow(int i, const QVector<float> &scores)
+    {
+        if (file.isNull() || targetFiles.isEmpty()) return;
+
+        // Format the row outside the lock
+        QList<QByteArray> row;
+        if (binary) {
+            QVector<qint32> query, target;
+            QVector<quint8> mask;
+            QVector<float> score;
             for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
                 const bool genuine = queryLabels[i] == targetLabels[j];
                 if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
-                lines.append(QString("%1,%2,%3,%4%5").arg(queryFiles[i],
-                                                          targetFiles[j],
-                                                          QString::number(genuine),
-                                                          QString::number(data.at<float>(i,j)),
-                                                          values));
+                query.append(i);
+                target.append(j);
+                mask.append(genuine);
+                score.append(scores[j]);
             }
+            row.append(QByteArray((const char*)query.data(), query.size()*sizeof(qint32)));
+            row.append(QByteArray((const char*)target.data(), target.size()*sizeof(qint32)));
+            row.append(QByteArray((const char*)mask.data(), mask.size()*sizeof(quint8)));
+            row.append(QByteArray((const char*)score.data(), score.size()*sizeof(float)));
+        } else {
+            QString lines;
+            for (int j=(selfSimilar ? i+1 : 0); j<targetFiles.size(); j++) {
+                const bool genuine = queryLabels[i] == targetLabels[j];
+                if ((genuineOnly && !genuine) || (impostorOnly && genuine)) continue;
+                lines.append(QString("%1,%2,%3,%4%5\n").arg(queryFiles[i],
+                                                            targetFiles[j],
+                                                            QString::number(genuine),
+                                                            QString::number(scores[j]),
+                                                            values));
+            }
+            row.append(lines.toLocal8Bit());
         }
 
-        QtUtils::writeFile(file, lines);
+        QMutexLocker locker(&writeLock);
+        pendingRows.insert(i, row);
+        while (!pendingRows.isEmpty() && (pendingRows.firstKey() == nextRow)) {
+            const QList<QByteArray> next = pendingRows.take(nextRow++);
+            if (binary) {
+                for (int c=0; c<Columns; c++)
+                    columns[c].write(next[c]);
+            } else if (file.baseName() == "terminal") {
+                fwrite(next.first().constData(), 1, next.first().size(), stdout);
+            } else if (file.baseName() == "buffer") {
+                buffer.append(next.first());
+            } else {
+                f.write(next.first());
+            }
+        }
     }
 };
 
@@ -14,7 +14,13 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif // _WIN32
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
@@ -23,6 +29,12 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief \ref simmat output.
+ *
+ * The file is sized up front without writing the score matrix, which stays sparse on file systems that support it, and is memory mapped.
+ * Scores are written directly into the mapping, so concurrent comparisons writing disjoint cells need no locking.
+ * \em flush controls what happens to the previous block at each block boundary:
+ * \c none leaves write back to the operating system, \c async schedules it and \c sync waits for it (POSIX only).
+ * \em halfPrecision stores scores as IEEE half floats, halving the file size at roughly three significant digits of precision.
  * \author Josh Klontz \cite jklontz
  */
 class mtxOutput : public Output
@@ -31,24 +43,45 @@ class mtxOutput : public Output
 
     Q_PROPERTY(QString targetGallery READ get_targetGallery WRITE set_targetGallery RESET reset_targetGallery STORED false)
     Q_PROPERTY(QString queryGallery READ get_queryGallery WRITE set_queryGallery RESET reset_queryGallery STORED false)
+    Q_PROPERTY(QString flush READ get_flush WRITE set_flush RESET reset_flush STORED false)
     BR_PROPERTY(QString, targetGallery, "Unknown_Target")
     BR_PROPERTY(QString, queryGallery, "Unknown_Query")
+    Q_PROPERTY(bool halfPrecision READ get_halfPrecision WRITE set_halfPrecision RESET reset_halfPrecision STORED false)
+    BR_PROPERTY(QString, flush, "none")
+    BR_PROPERTY(bool, halfPrecision, false)
+
+    QFile f;
+    uchar *mapping, *scores;
+    int rowBlock, columnBlock, rowOffset, columnOffset, matrixRows, elemSize;
 
-    int headerSize, rowBlock, columnBlock;
-    cv::Mat blockScores;
+public:
+    mtxOutput() : mapping(NULL), scores(NULL), matrixRows(0), elemSize(sizeof(float)) {}
 
+private:
     ~mtxOutput()
     {
-        writeBlock();
+        close();
+    }
+
+    void close()
+    {
+        if (mapping == NULL)
+            return;
+        flushBlock();
+        f.unmap(mapping);
+        f.close();
+        mapping = NULL;
+        scores = NULL;
     }
 
     void setBlock(int rowBlock, int columnBlock)
     {
         if ((rowBlock == 0) && (columnBlock == 0)) {
             // Initialize the file
-            QFile f(file);
+            close();
+            f.setFileName(file);
             QtUtils::touchDir(f);
-            if (!f.open(QFile::WriteOnly))
+            if (!f.open(QFile::ReadWrite | QFile::Truncate))
                 qFatal("Unable to open %s for writing.", qPrintable(file));
             const int endian = 0x12345678;
             QByteArray header;
@@ -56,34 +89,53 @@ class mtxOutput : public Output
             header.append(qPrintable(targetGallery));
             header.append("\n");
             header.append(qPrintable(queryGallery));
-            header.append("\nMF ");
+            header.append(halfPrecision ? "\nMH " : "\nMF ");
             header.append(qPrintable(QString::number(queryFiles.size())));
             header.append(" ");
             header.append(qPrintable(QString::number(targetFiles.size())));
             header.append(" ");
             header.append(QByteArray((const char*)&endian, 4));
             header.append("\n");
-            headerSize = f.write(header);
-            const float defaultValue = -std::numeric_limits<float>::max();
-            for (int i=0; i<targetFiles.size()*queryFiles.size(); i++)
-                f.write((const char*)&defaultValue, 4);
-            f.close();
+            const qint64 headerSize = f.write(header);
+
+            // Every cell is assigned by the comparison, so the scores are not pre-filled
+            elemSize = halfPrecision ? sizeof(BEE::HalfSimmatValue) : sizeof(BEE::SimmatValue);
+            const qint64 fileSize = headerSize + qint64(elemSize)*qint64(targetFiles.size())*qint64(queryFiles.size());
+            if (!f.resize(fileSize))
+                qFatal("Unable to resize %s to %lld bytes.", qPrintable(file), fileSize);
+            mapping = f.map(0, fileSize);
+            if (mapping == NULL)
+                qFatal("Unable to map %s.", qPrintable(file));
+            scores = mapping + headerSize;
         } else {
-            writeBlock();
+            flushBlock();
         }
 
         this->rowBlock = rowBlock;
         this->columnBlock = columnBlock;
+        rowOffset = rowBlock*this->blockRows;
+        columnOffset = columnBlock*this->blockCols;
+        matrixRows = std::min(queryFiles.size()-rowOffset, blockRows);
+    }
 
-        int matrixRows  = std::min(queryFiles.size()-rowBlock*this->blockRows, blockRows);
-        int matrixCols  = std::min(targetFiles.size()-columnBlock*this->blockCols, blockCols);
-
-        blockScores = cv::Mat(matrixRows, matrixCols, CV_32FC1);
+    uchar *cell(int i, int j) const
+    {
+        return scores + (qint64(i)*targetFiles.size() + j)*elemSize;
     }
 
     void setRelative(float value, int i, int j)
     {
-        blockScores.at<float>(i,j) = value;
+        if (halfPrecision) *reinterpret_cast<quint16*>(cell(rowOffset+i, columnOffset+j)) = BEE::toHalf(value);
+        else               *reinterpret_cast<float*>(cell(rowOffset+i, columnOffset+j)) = value;
+    }
+
+    void setBlockScores(int rowOffset, int columnOffset, const cv::Mat &scores)
+    {
+        for (int r=0; r<scores.rows; r++) {
+            uchar *dst = cell(this->rowOffset+rowOffset+r, this->columnOffset+columnOffset);
+            if (halfPrecision) BEE::toHalf(scores.ptr<float>(r), reinterpret_cast<quint16*>(dst), scores.cols);
+            else               memcpy(dst, scores.ptr<float>(r), sizeof(float)*scores.cols);
+        }
     }
 
     void set(float value, int i, int j)
@@ -92,16 +144,20 @@ class mtxOutput : public Output
         qFatal("Logic error.");
     }
 
-    void writeBlock()
+    // Writes back the rows spanned by the current block according to the flush strategy
+    void flushBlock()
     {
-        QFile f(file);
-        if (!f.open(QFile::ReadWrite))
-            qFatal("Unable to open %s for modifying.", qPrintable(file));
-        for (int i=0; i<blockScores.rows; i++) {
-            f.seek(headerSize + sizeof(float)*(quint64(rowBlock*this->blockRows+i)*targetFiles.size()+(columnBlock*this->blockCols)));
-            f.write((const char*)blockScores.row(i).data, sizeof(float)*blockScores.cols);
-        }
-        f.close();
+        if ((mapping == NULL) || (matrixRows <= 0) || (flush == "none"))
+            return;
+
+#ifndef _WIN32
+        const qint64 pageSize = sysconf(_SC_PAGESIZE);
+        const uchar *begin = cell(rowOffset, 0);
+        const uchar *end = cell(rowOffset+matrixRows, 0);
+        const qint64 alignment = (begin - mapping) % pageSize;
+        if (msync((void*)(begin - alignment), end - begin + alignment, (flush == "sync") ? MS_SYNC : MS_ASYNC) != 0)
+            qWarning("Failed to flush %s.", qPrintable(file));
+#endif // _WIN32
     }
 };
 
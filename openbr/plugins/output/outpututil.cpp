@@ -0,0 +1,101 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+struct ScoresRow : public RowOutput::Row
+{
+    QVector<float> scores;
+};
+
+RowOutput::~RowOutput()
+{
+    qDeleteAll(rows);
+}
+
+void RowOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
+{
+    Output::initialize(targetFiles, queryFiles);
+    qDeleteAll(rows);
+    rows.fill(NULL, queryFiles.size());
+}
+
+void RowOutput::finalize()
+{
+    for (int i=0; i<rows.size(); i++) {
+        if (rows[i] == NULL)
+            continue;
+        QScopedPointer<Row> row(rows[i]);
+        rows[i] = NULL;
+        finishRow(row.data(), i);
+    }
+}
+
+RowOutput::Row *RowOutput::makeRow(int)
+{
+    ScoresRow *row = new ScoresRow();
+    row->scores.fill(-std::numeric_limits<float>::max(), targetFiles.size());
+    return row;
+}
+
+void RowOutput::addScores(Row *row, int, int j, const float *scores, int count)
+{
+    memcpy(static_cast<ScoresRow*>(row)->scores.data() + j, scores, sizeof(float)*count);
+}
+
+void RowOutput::finishRow(Row *row, int i)
+{
+    setRow(i, static_cast<ScoresRow*>(row)->scores);
+}
+
+void RowOutput::setRow(int, const QVector<float> &)
+{
+    qFatal("Logic error: %s did not implement setRow() or finishRow().", metaObject()->className());
+}
+
+void RowOutput::set(float value, int i, int j)
+{
+    add(i, j, &value, 1);
+}
+
+void RowOutput::setScores(const cv::Mat &scores, int i, int j)
+{
+    for (int r=0; r<scores.rows; r++)
+        add(i+r, j, scores.ptr<float>(r), scores.cols);
+}
+
+void RowOutput::add(int i, int j, const float *scores, int count)
+{
+    QMutexLocker locker(&locks[i % Stripes]);
+    Row *&row = rows[i];
+    if (row == NULL)
+        row = makeRow(i);
+    addScores(row, i, j, scores, count);
+    row->count += count;
+    if (row->count < targetFiles.size())
+        return;
+
+    // The row is complete, hand it off outside the lock
+    QScopedPointer<Row> complete(row);
+    row = NULL;
+    locker.unlock();
+    finishRow(complete.data(), i);
+}
+
+} // namespace br
@@ -25,46 +25,135 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Outputs highest ranked matches with scores.
+ *
+ * Each incomplete row keeps its best genuine match so far and the eligible scores ranked ahead of it,
+ * so memory is proportional to the rank rather than the number of targets once a genuine match is seen.
  * \author Scott Klum \cite sklum
  */
-class rankOutput : public MatrixOutput
+class rankOutput : public RowOutput
 {
     Q_OBJECT
 
+    struct Result
+    {
+        int rank, position;
+        float score;
+        Result() : rank(-1), position(-1), score(0) {}
+    };
+
+    typedef QPair<float,int> Pair; // QPair<Score,Target>
+
+    struct RankRow : public Row
+    {
+        int best; // The best eligible genuine target so far, -1 if none
+        float bestScore;
+        QVector<Pair> ahead; // Eligible scores before best, or all of them if there is no best yet
+        RankRow() : best(-1), bestScore(0) {}
+    };
+
+    QVector<int> targetLabels, queryLabels, targetNames, queryNames, targetPartitions, queryPartitions;
+    QVector<Result> results;
+
     ~rankOutput()
     {
+        finalize();
         if (targetFiles.isEmpty() || queryFiles.isEmpty()) return;
 
-        QList<int> ranks;
-        QList<int> positions;
-        QList<float> scores;
-        QStringList lines;
-
-        for (int i=0; i<queryFiles.size(); i++) {
-            typedef QPair<float,int> Pair;
-            int rank = 1;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (QString(targetFiles[pair.second]) != QString(queryFiles[i])) {
-                        if (targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
-                            ranks.append(rank);
-                            positions.append(pair.second);
-                            scores.append(pair.first);
-                            break;
-                        }
-                        rank++;
-                    }
-                }
-            }
+        typedef QPair<int,int> RankPair; // QPair<Rank,Query>
+        QList<RankPair> ranks;
+        for (int i=0; i<results.size(); i++)
+            if (results[i].rank != -1)
+                ranks.append(RankPair(results[i].rank, i));
+        std::sort(ranks.begin(), ranks.end());
+
+        QStringList lines; lines.reserve(ranks.size());
+        foreach (const RankPair &pair, ranks)
+            lines.append(queryFiles[pair.second].name + " " + QString::number(pair.first) + " " + QString::number(results[pair.second].score) + " " + targetFiles[results[pair.second].position].name);
+
+        QtUtils::writeFile(file, lines);
+    }
+
+    static QVector<int> intern(const QStringList &values, QHash<QString,int> &ids)
+    {
+        QVector<int> result; result.reserve(values.size());
+        foreach (const QString &value, values) {
+            QHash<QString,int>::const_iterator it = ids.constFind(value);
+            if (it == ids.constEnd())
+                it = ids.insert(value, ids.size());
+            result.append(it.value());
         }
+        return result;
+    }
 
-        typedef QPair<int,int> RankPair;
-        foreach (const RankPair &pair, Common::Sort(ranks, false))
-            // pair.first == rank retrieved, pair.second == original position
-            lines.append(queryFiles[pair.second].name + " " + QString::number(pair.first) + " " + QString::number(scores[pair.second]) + " " + targetFiles[positions[pair.second]].name);
+    static QVector<int> partitions(const FileList &files)
+    {
+        QVector<int> result; result.reserve(files.size());
+        foreach (const File &f, files)
+            result.append(Globals->crossValidate > 0 ? f.get<int>("Partition", -1) : -1);
+        return result;
+    }
 
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        RowOutput::initialize(targetFiles, queryFiles);
 
-        QtUtils::writeFile(file, lines);
+        QHash<QString,int> labels, names;
+        targetLabels = intern(File::get<QString>(targetFiles, "Label"), labels);
+        queryLabels = intern(File::get<QString>(queryFiles, "Label"), labels);
+        targetNames = intern(targetFiles.names(), names);
+        queryNames = intern(queryFiles.names(), names);
+        targetPartitions = partitions(targetFiles);
+        queryPartitions = partitions(queryFiles);
+        results = QVector<Result>(queryFiles.size());
+    }
+
+    // Common::Sort order, descending score then descending index
+    static bool before(float scoreA, int a, float scoreB, int b)
+    {
+        return (scoreA > scoreB) || ((scoreA == scoreB) && (a > b));
+    }
+
+    Row *makeRow(int)
+    {
+        return new RankRow();
+    }
+
+    void addScores(Row *row, int i, int j, const float *scores, int count)
+    {
+        RankRow &rankRow = *static_cast<RankRow*>(row);
+        for (int k=0; k<count; k++) {
+            const int t = j+k;
+            if (((targetPartitions[t] != -1) && (targetPartitions[t] != queryPartitions[i])) || (targetNames[t] == queryNames[i]))
+                continue;
+            if ((rankRow.best != -1) && !before(scores[k], t, rankRow.bestScore, rankRow.best))
+                continue;
+
+            if (targetLabels[t] != queryLabels[i]) {
+                rankRow.ahead.append(Pair(scores[k], t));
+                continue;
+            }
+
+            // A new best genuine, drop the scores no longer ahead of it
+            rankRow.best = t;
+            rankRow.bestScore = scores[k];
+            int kept = 0;
+            for (int a=0; a<rankRow.ahead.size(); a++)
+                if (before(rankRow.ahead[a].first, rankRow.ahead[a].second, rankRow.bestScore, rankRow.best))
+                    rankRow.ahead[kept++] = rankRow.ahead[a];
+            rankRow.ahead.resize(kept);
+        }
+    }
+
+    void finishRow(Row *row, int i)
+    {
+        const RankRow &rankRow = *static_cast<RankRow*>(row);
+        if (rankRow.best == -1)
+            return;
+
+        Result &result = results[i];
+        result.rank = rankRow.ahead.size() + 1;
+        result.position = rankRow.best;
+        result.score = rankRow.bestScore;
     }
 };
 
@@ -25,41 +25,129 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Rank retrieval output.
+ *
+ * Each incomplete row keeps only its \em limit highest scores.
  * \author Josh Klontz \cite jklontz
  * \author Scott Klum \cite sklum
  */
-class rrOutput : public MatrixOutput
+class rrOutput : public RowOutput
 {
     Q_OBJECT
 
+    // Ordered as Common::Sort, descending score then descending index
+    typedef QPair<float,int> Pair;
+
+    // The highest scores of a row so far, as a heap with the lowest first
+    struct TopRow : public Row
+    {
+        QVector<Pair> top;
+    };
+
+    int limit;
+    bool byLine, simple, progressive;
+    float threshold;
+    QVector<int> targetPartitions, queryPartitions;
+
+    // Guarded by linesLock, completed rows are written in query order as soon as possible
+    QMutex linesLock;
+    QMap<int,QString> pendingLines;
+    QStringList lines;
+    QFile f;
+    int nextRow;
+
     ~rrOutput()
     {
+        finalize();
         if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        const int limit = file.get<int>("limit", 20);
-        const bool byLine = file.getBool("byLine");
-        const bool simple = file.getBool("simple");
-        const float threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
-
-        QStringList lines;
-
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList files;
-            if (simple) files.append(queryFiles[i].fileName());
-
-            typedef QPair<float,int> Pair;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true, limit)) {
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (pair.first < threshold) break;
-                    File target = targetFiles[pair.second];
-                    target.set("Score", QString::number(pair.first));
-                    if (simple) files.append(target.fileName() + " " + QString::number(pair.first));
-                    else files.append(target.flat());
-                }
+
+        if (progressive) f.close();
+        else             QtUtils::writeFile(file, lines);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        RowOutput::initialize(targetFiles, queryFiles);
+        limit = file.get<int>("limit", 20);
+        byLine = file.getBool("byLine");
+        simple = file.getBool("simple");
+        threshold = file.get<float>("threshold", -std::numeric_limits<float>::max());
+
+        targetPartitions.clear();
+        foreach (const File &target, targetFiles)
+            targetPartitions.append(Globals->crossValidate > 0 ? target.get<int>("Partition", -1) : -1);
+        queryPartitions.clear();
+        foreach (const File &query, queryFiles)
+            queryPartitions.append(Globals->crossValidate > 0 ? query.get<int>("Partition", -1) : -1);
+
+        // Regular files are appended to as rows complete, terminal and buffer are written at the end
+        const QString baseName = QFileInfo(file.name).baseName();
+        progressive = !file.isNull() && (baseName != "terminal") && (baseName != "buffer");
+        pendingLines.clear();
+        lines.clear();
+        nextRow = 0;
+    }
+
+    Row *makeRow(int)
+    {
+        TopRow *row = new TopRow();
+        row->top.reserve(std::max(0, std::min(limit, targetFiles.size())));
+        return row;
+    }
+
+    void addScores(Row *row, int, int j, const float *scores, int count)
+    {
+        if (file.isNull() || (limit <= 0)) return;
+
+        QVector<Pair> &top = static_cast<TopRow*>(row)->top;
+        for (int k=0; k<count; k++) {
+            const Pair pair(scores[k], j+k);
+            if (top.size() < limit) {
+                top.append(pair);
+                std::push_heap(top.begin(), top.end(), std::greater<Pair>());
+            } else if (std::greater<Pair>()(pair, top.first())) {
+                std::pop_heap(top.begin(), top.end(), std::greater<Pair>());
+                top.last() = pair;
+                std::push_heap(top.begin(), top.end(), std::greater<Pair>());
+            }
+        }
+    }
+
+    void finishRow(Row *row, int i)
+    {
+        if (file.isNull()) return;
+
+        QVector<Pair> &top = static_cast<TopRow*>(row)->top;
+        std::sort_heap(top.begin(), top.end(), std::greater<Pair>());
+
+        QStringList files;
+        if (simple) files.append(queryFiles[i].fileName());
+        foreach (const Pair &pair, top) {
+            if ((targetPartitions[pair.second] == -1) || (targetPartitions[pair.second] == queryPartitions[i])) {
+                if (pair.first < threshold) break;
+                File target = targetFiles[pair.second];
+                target.set("Score", QString::number(pair.first));
+                if (simple) files.append(target.fileName() + " " + QString::number(pair.first));
+                else files.append(target.flat());
             }
-            lines.append(files.join(byLine ? "\n" : ","));
         }
 
-        QtUtils::writeFile(file, lines);
+        QMutexLocker locker(&linesLock);
+        pendingLines.insert(i, files.join(byLine ? "\n" : ","));
+        while (!pendingLines.isEmpty() && (pendingLines.firstKey() == nextRow)) {
+            const QString line = pendingLines.take(nextRow++);
+            if (progressive) {
+                if (!f.isOpen()) {
+                    f.setFileName(file);
+                    QtUtils::touchDir(f);
+                    if (!f.open(QFile::WriteOnly))
+                        qFatal("Failed to open %s for writing.", qPrintable(file));
+                }
+                f.write((line+"\n").toLocal8Bit());
+                f.flush();
+            } else {
+                lines.append(line);
+            }
+        }
     }
 };
 
@@ -0,0 +1,173 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Sparse \ref simmat output in compressed sparse row order.
+ *
+ * Only scores at or above \em threshold, and at most the \em topK best per row (all if 0), are kept.
+ * Rows are written as soon as their row block completes, so blocks must arrive in row-major order.
+ * Readers of \c .mtx files also accept \c .smtx files, missing scores read as \c -FLT_MAX.
+ */
+class smtxOutput : public Output
+{
+    Q_OBJECT
+
+    Q_PROPERTY(QString targetGallery READ get_targetGallery WRITE set_targetGallery RESET reset_targetGallery STORED false)
+    Q_PROPERTY(QString queryGallery READ get_queryGallery WRITE set_queryGallery RESET reset_queryGallery STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(int topK READ get_topK WRITE set_topK RESET reset_topK STORED false)
+    Q_PROPERTY(bool halfPrecision READ get_halfPrecision WRITE set_halfPrecision RESET reset_halfPrecision STORED false)
+    BR_PROPERTY(QString, targetGallery, "Unknown_Target")
+    BR_PROPERTY(QString, queryGallery, "Unknown_Query")
+    BR_PROPERTY(float, threshold, -std::numeric_limits<float>::max())
+    BR_PROPERTY(int, topK, 0)
+    BR_PROPERTY(bool, halfPrecision, false)
+
+    typedef QPair<float,int> Entry; // QPair<Score,Column>
+    static const int Stripes = 64;
+
+    QFile f;
+    QVector< QVector<Entry> > rows; // Pending entries of unwritten rows
+    QVector<qint64> rowPointers;
+    QMutex locks[Stripes];
+    int nextRow;
+
+    // Orders the smallest kept score first so that it is the one replaced
+    static bool greaterEntry(const Entry &a, const Entry &b)
+    {
+        return a.first > b.first;
+    }
+
+    ~smtxOutput()
+    {
+        if (!f.isOpen())
+            return;
+        writeRows(queryFiles.size());
+        const qint64 nnz = rowPointers.last();
+        f.write((const char*)rowPointers.data(), sizeof(qint64)*rowPointers.size());
+        f.write((const char*)&nnz, sizeof(qint64));
+        f.close();
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        rows.clear();
+        rows.resize(queryFiles.size());
+        rowPointers.clear();
+        rowPointers.reserve(queryFiles.size()+1);
+        rowPointers.append(0);
+        nextRow = 0;
+    }
+
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        if (!f.isOpen()) {
+            f.setFileName(file);
+            QtUtils::touchDir(f);
+            if (!f.open(QFile::WriteOnly))
+                qFatal("Unable to open %s for writing.", qPrintable(file));
+            const int endian = 0x12345678;
+            QByteArray header;
+            header.append("S2\n");
+            header.append(qPrintable(targetGallery));
+            header.append("\n");
+            header.append(qPrintable(queryGallery));
+            header.append(halfPrecision ? "\nCH " : "\nCF ");
+            header.append(qPrintable(QString::number(queryFiles.size())));
+            header.append(" ");
+            header.append(qPrintable(QString::number(targetFiles.size())));
+            header.append(" ");
+            header.append(QByteArray((const char*)&endian, 4));
+            header.append("\n");
+            f.write(header);
+        }
+
+        // Rows above the new row block are complete
+        const int firstRow = std::max(rowBlock, 0) * blockRows;
+        if (firstRow < nextRow)
+            qFatal("Sparse similarity matrices require blocks in row-major order.");
+        writeRows(std::min(firstRow, queryFiles.size()));
+
+        Output::setBlock(rowBlock, columnBlock);
+    }
+
+    void set(float value, int i, int j)
+    {
+        if ((value < threshold) || (value == -std::numeric_limits<float>::max()))
+            return;
+
+        QMutexLocker locker(&locks[i % Stripes]);
+        QVector<Entry> &entries = rows[i];
+        if ((topK <= 0) || (entries.size() < topK)) {
+            entries.append(Entry(value, j));
+            if (topK > 0)
+                std::push_heap(entries.begin(), entries.end(), greaterEntry);
+        } else if (value > entries.first().first) {
+            std::pop_heap(entries.begin(), entries.end(), greaterEntry);
+            entries.last() = Entry(value, j);
+            std::push_heap(entries.begin(), entries.end(), greaterEntry);
+        }
+    }
+
+    void writeRows(int end)
+    {
+        const int entrySize = sizeof(qint32) + (halfPrecision ? sizeof(quint16) : sizeof(float));
+        QByteArray buffer;
+        for (; nextRow<end; nextRow++) {
+            QVector<Entry> entries;
+            entries.swap(rows[nextRow]);
+
+            // Columns ascending within a row
+            std::sort(entries.begin(), entries.end(), compareColumns);
+
+            buffer.resize(entries.size()*entrySize);
+            char *entry = buffer.data();
+            foreach (const Entry &e, entries) {
+                const qint32 column = e.second;
+                memcpy(entry, &column, sizeof(qint32));
+                if (halfPrecision) {
+                    const quint16 score = BEE::toHalf(e.first);
+                    memcpy(entry + sizeof(qint32), &score, sizeof(quint16));
+                } else {
+                    memcpy(entry + sizeof(qint32), &e.first, sizeof(float));
+                }
+                entry += entrySize;
+            }
+            f.write(buffer);
+            rowPointers.append(rowPointers.last() + entries.size());
+        }
+    }
+
+    static bool compareColumns(const Entry &a, const Entry &b)
+    {
+        return a.second < b.second;
+    }
+};
+
+BR_REGISTER(Output, smtxOutput)
+
+} // namespace br
+
+#include "output/smtx.moc"
@@ -13,6 +13,8 @@
  * See the License for the specific language governing permissions and       *
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <QThreadStorage>
+
 #include <openbr/plugins/openbr_internal.h>
 
 #include <openbr/core/qtutils.h>
@@ -23,6 +25,9 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief The highest scoring matches.
+ *
+ * Each comparison thread keeps its own bounded candidate heap, so scores that can't make the tail are rejected without synchronization.
+ * The heaps are merged when the output is destroyed.
  * \author Josh Klontz \cite jklontz
  */
 class tailOutput : public Output
@@ -31,37 +36,76 @@ class tailOutput : public Output
 
     struct Comparison
     {
-        br::File query, target;
         float value;
+        int query, target;
 
-        Comparison(const br::File &_query, const br::File &_target, float _value)
-            : query(_query), target(_target), value(_value) {}
+        Comparison(float _value, int _query, int _target)
+            : value(_value), query(_query), target(_target) {}
 
-        QString toString(bool args) const
+        // Heap order, the lowest score is at the front
+        bool operator<(const Comparison &other) const
         {
-            return QString::number(value) + "," + (args ? target.flat() : (QString)target) + "," + (args ? query.flat() : (QString)query);
+            return value > other.value;
         }
 
-        bool operator<(const Comparison &other) const
+        // Output order, highest score first
+        static bool descending(const Comparison &a, const Comparison &b)
         {
-            return value < other.value;
+            if (a.value != b.value) return a.value > b.value;
+            if (a.query != b.query) return a.query < b.query;
+            return a.target < b.target;
         }
     };
 
+    // The local tail of one thread
+    struct Candidates
+    {
+        QVector<Comparison> heap;
+    };
+
+    // The candidates most recently used by the current thread
+    struct Cache
+    {
+        int owner;
+        Candidates *candidates;
+    };
+
+    static QAtomicInt instances;
+    static QThreadStorage<Cache*> cache;
+
     float threshold;
     int atLeast, atMost;
     bool args;
-    float lastValue;
-    QList<Comparison> comparisons;
-    QMutex comparisonsLock;
+    int id;
+    QHash<Qt::HANDLE, Candidates*> candidates;
+    QMutex candidatesLock;
 
+public:
+    tailOutput() : id(instances.fetchAndAddOrdered(1)) {}
+
+private:
     ~tailOutput()
     {
+        QVector<Comparison> comparisons;
+        foreach (Candidates *local, candidates) {
+            comparisons += local->heap;
+            delete local;
+        }
+
         if (file.isNull() || comparisons.isEmpty()) return;
-        QStringList lines; lines.reserve(comparisons.size()+1);
+
+        std::sort(comparisons.begin(), comparisons.end(), Comparison::descending);
+        int size = std::min(comparisons.size(), atMost);
+        while ((size > atLeast) && (comparisons[size-1].value < threshold))
+            size--;
+
+        QStringList lines; lines.reserve(size+1);
         lines.append("Value,Target,Query");
-        foreach (const Comparison &duplicate, comparisons)
-            lines.append(duplicate.toString(args));
+        for (int k=0; k<size; k++) {
+            const File &target = targetFiles[comparisons[k].target];
+            const File &query = queryFiles[comparisons[k].query];
+            lines.append(QString::number(comparisons[k].value) + "," + (args ? target.flat() : (QString)target) + "," + (args ? query.flat() : (QString)query));
+        }
         QtUtils::writeFile(file, lines);
     }
 
@@ -72,42 +116,64 @@ class tailOutput : public Output
         atLeast = file.get<int>("atLeast", 1);
         atMost = file.get<int>("atMost", std::numeric_limits<int>::max());
         args = file.get<bool>("args", false);
-        lastValue = -std::numeric_limits<float>::max();
+    }
+
+    Candidates *localCandidates()
+    {
+        if (!cache.hasLocalData())
+            cache.setLocalData(new Cache());
+        Cache *local = cache.localData();
+        if ((local->owner != id) || (local->candidates == NULL)) {
+            QMutexLocker locker(&candidatesLock);
+            Candidates *&threadCandidates = candidates[QThread::currentThreadId()];
+            if (threadCandidates == NULL)
+                threadCandidates = new Candidates();
+            local->owner = id;
+            local->candidates = threadCandidates;
+        }
+        return local->candidates;
     }
 
     void set(float value, int i, int j)
     {
         // Return early for self similar matrices
         if (selfSimilar && (i <= j)) return;
+        insert(localCandidates()->heap, value, i, j);
+    }
 
-        // Consider only values passing the criteria
-        if ((value < threshold) && (value <= lastValue) && (comparisons.size() >= atLeast))
-            return;
-
-        comparisonsLock.lock();
-        if (comparisons.isEmpty() || (value < comparisons.last().value)) {
-            // Special cases
-            comparisons.append(Comparison(queryFiles[i], targetFiles[j], value));
-        } else {
-            // General case
-            for (int k=0; k<comparisons.size(); k++) {
-                if (comparisons[k].value <= value) {
-                    comparisons.insert(k, Comparison(queryFiles[i], targetFiles[j], value));
-                    break;
-                }
-            }
+    void setScores(const cv::Mat &scores, int i, int j)
+    {
+        QVector<Comparison> &heap = localCandidates()->heap;
+        for (int r=0; r<scores.rows; r++) {
+            const float *row = scores.ptr<float>(r);
+            // Only the lower triangle of self similar matrices
+            const int end = selfSimilar ? std::min(scores.cols, i+r-j) : scores.cols;
+            for (int c=0; c<end; c++)
+                insert(heap, row[c], i+r, j+c);
         }
+    }
 
-        while (comparisons.size() > atMost)
-            comparisons.removeLast();
-        while ((comparisons.size() > atLeast) && (comparisons.last().value < threshold))
-            comparisons.removeLast();
+    void insert(QVector<Comparison> &heap, float value, int i, int j) const
+    {
+        // Consider only values that can still make this thread's tail
+        if (!heap.isEmpty() && (value <= heap.first().value) &&
+            (heap.size() >= atMost || ((value < threshold) && (heap.size() >= atLeast))))
+            return;
 
-        lastValue = comparisons.last().value;
-        comparisonsLock.unlock();
+        heap.append(Comparison(value, i, j));
+        std::push_heap(heap.begin(), heap.end());
+
+        while ((heap.size() > atMost) ||
+               ((heap.size() > atLeast) && (heap.first().value < threshold))) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.removeLast();
+        }
     }
 };
 
+QAtomicInt tailOutput::instances;
+QThreadStorage<tailOutput::Cache*> tailOutput::cache;
+
 BR_REGISTER(Output, tailOutput)
 
 } // namespace br
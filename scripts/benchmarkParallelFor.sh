@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Compares work-stealing chunks (-workStealing true) against the original one
+# future per template and per block (-workStealing false) at increasing
+# parallelism. Enrollment runs through -project, which calls
+# Transform::project(TemplateList) directly instead of through a Stream.
+# Comparison runs all against all, and one query against all targets, with a
+# cheap (16x16) and an expensive (full image) L2 distance.
+
+if [ ! -f benchmarkParallelFor.sh ]; then
+  echo "Run this script from the scripts folder!"
+  exit
+fi
+
+if ! hash br 2>/dev/null; then
+  echo "Can't find 'br'. Did you forget to build and install OpenBR? Here's some help: http://openbiometrics.org/doxygen/latest/installation.html"
+  exit
+fi
+
+# Get the data
+./downloadDatasets.sh
+
+INPUT=../data/BioID/img
+FIRST=${INPUT}/$(ls ${INPUT} | head -1)
+TEMPLATES=$(ls ${INPUT} | wc -l)
+CHEAP="Open+Cvt(Gray)+Resize(16,16)+Cat:L2"
+EXPENSIVE="Open+Cvt(Gray)+Cat:L2"
+MAX=$(nproc)
+
+seconds() {
+  START=$(date +%s.%N)
+  "$@" > /dev/null
+  END=$(date +%s.%N)
+  echo "${END} - ${START}" | bc -l
+}
+
+echo "parallelism,workStealing,workload,perSecond"
+for ((P=1; P<=MAX; P*=2)); do
+  for WORKSTEALING in false true; do
+    BR="br -quiet true -parallelism ${P} -workStealing ${WORKSTEALING}"
+    for WORKLOAD in cheap expensive; do
+      ALGORITHM=${CHEAP}
+      if [ ${WORKLOAD} = expensive ]; then ALGORITHM=${EXPENSIVE}; fi
+      rm -f benchmarkParallelFor.gal benchmarkParallelForQuery.gal
+      S=$(seconds ${BR} -algorithm "${ALGORITHM}" -project ${INPUT} benchmarkParallelFor.gal)
+      echo "${P},${WORKSTEALING},project-${WORKLOAD},$(echo "${TEMPLATES} / ${S}" | bc -l)"
+      ${BR} -algorithm "${ALGORITHM}" -project ${FIRST} benchmarkParallelForQuery.gal > /dev/null
+
+      S=$(seconds ${BR} -algorithm "${ALGORITHM}" -compare benchmarkParallelFor.gal benchmarkParallelFor.gal benchmarkParallelFor.mtx)
+      echo "${P},${WORKSTEALING},compare-${WORKLOAD},$(echo "${TEMPLATES} * ${TEMPLATES} / ${S}" | bc -l)"
+
+      S=$(seconds ${BR} -algorithm "${ALGORITHM}" -compare benchmarkParallelFor.gal benchmarkParallelForQuery.gal benchmarkParallelFor.mtx)
+      echo "${P},${WORKSTEALING},compareOneQuery-${WORKLOAD},$(echo "${TEMPLATES} / ${S}" | bc -l)"
+    done
+  done
+done
+
+rm -f benchmarkParallelFor.gal benchmarkParallelForQuery.gal benchmarkParallelFor.mtx
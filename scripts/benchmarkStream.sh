@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# Measures stream throughput in frames/sec for the lock-free and the locking
+# stage buffers. Stages are trivial time-varying transforms so every frame
+# crosses a buffer between stages and buffer handoff dominates the run time.
+
+if [ ! -f benchmarkStream.sh ]; then
+  echo "Run this script from the scripts folder!"
+  exit
+fi
+
+if ! hash br 2>/dev/null; then
+  echo "Can't find 'br'. Did you forget to build and install OpenBR? Here's some help: http://openbiometrics.org/doxygen/latest/installation.html"
+  exit
+fi
+
+# Get the data
+./downloadDatasets.sh
+
+INPUT=../data/BioID/img
+FRAMES=$(ls ${INPUT} | wc -l)
+REPEATS=${REPEATS:-5}
+
+echo "stages,lockFreeStreams,framesPerSecond"
+for STAGES in 1 2 4 8 16; do
+  ALGORITHM="Identity"
+  for ((i=0; i<STAGES; i++)); do
+    ALGORITHM="${ALGORITHM}+AggregateFrames+Identity"
+  done
+
+  for LOCKFREE in true false; do
+    START=$(date +%s.%N)
+    for ((r=0; r<REPEATS; r++)); do
+      br -quiet true -lockFreeStreams ${LOCKFREE} -algorithm "${ALGORITHM}" -enroll ${INPUT} benchmarkStream.gal > /dev/null
+    done
+    END=$(date +%s.%N)
+    echo "${STAGES},${LOCKFREE},$(echo "${FRAMES} * ${REPEATS} / (${END} - ${START})" | bc -l)"
+  done
+done
+
+rm -f benchmarkStream.gal
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Measures stream throughput in frames/sec with fixed and adaptive thread
+# allotment. Stages are synthetic: a short sleep, a serial stage and a long
+# CPU-bound stage that is the bottleneck, optionally with a thread cap on the
+# first stage. Per-stage statistics are written to benchmarkStreamScheduling.json.
+
+if [ ! -f benchmarkStreamScheduling.sh ]; then
+  echo "Run this script from the scripts folder!"
+  exit
+fi
+
+if ! hash br 2>/dev/null; then
+  echo "Can't find 'br'. Did you forget to build and install OpenBR? Here's some help: http://openbiometrics.org/doxygen/latest/installation.html"
+  exit
+fi
+
+# Get the data
+./downloadDatasets.sh
+
+INPUT=../data/BioID/img
+FRAMES=$(ls ${INPUT} | wc -l)
+STAGES="Sleep(5)+Sleep(1,serial=true)+Sleep(20,busy=true)"
+rm -f benchmarkStreamScheduling.json
+
+echo "adaptiveThreads,threadCaps,framesPerSecond"
+for CAPS in "[]" "[2,0,0]"; do
+  for ADAPTIVE in false true; do
+    START=$(date +%s.%N)
+    br -quiet true -streamStatistics benchmarkStreamScheduling.json -algorithm "Stream(${STAGES},adaptiveThreads=${ADAPTIVE},threadCaps=${CAPS})" -enroll ${INPUT} benchmarkStreamScheduling.gal > /dev/null
+    END=$(date +%s.%N)
+    echo "${ADAPTIVE},${CAPS},$(echo "${FRAMES} / (${END} - ${START})" | bc -l)"
+  done
+done
+
+rm -f benchmarkStreamScheduling.gal